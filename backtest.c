@@ -0,0 +1,531 @@
+/*
+* Offline backtest of settlement rules against the bet journal of the server (JOURNAL_FILE).
+* Tickets of all races are matched against their finish orders in parallel, payouts under
+* the tested rules are then replayed race by race, carrying pools over as the server does.
+* The server is compiled into the tool, its main is renamed away.
+*/
+#define main server_main
+#include "server.c"
+#undef main
+
+#include <sys/stat.h>
+
+#define BT_NAMES_MIN 1024
+#define BT_WINNERS_MIN 4096
+#define BT_BASIS_POINTS 10000
+
+typedef struct {
+	long take_bp;			/* House take from new stakes of every pool, in basis points */
+	long min_pct;			/* Least payout of a winning ticket, in percent of its stake */
+	long unit;			/* Payouts are rounded down to a multiple of unit */
+	short breakage_house;		/* Rounding remainder goes to the house instead of carrying over (==1 if so) */
+	int workers;			/* Threads matching tickets */
+} payout_rules;
+
+typedef struct {
+	journal_entry* entry;		/* Entry of the race in the journal */
+	bet_book book;			/* Read-only view of the ticket columns */
+	long stakes[BET_TYPES];		/* New stakes by bet type */
+	long won[BET_TYPES];		/* Stakes of matching tickets by bet type */
+	int worker;			/* Worker that collected the winning tickets */
+	long winners;			/* Offset of winning tickets in the worker's list */
+	long winner_count;		/* Number of winning tickets */
+} bt_race;
+
+typedef struct {
+	bt_race* races;			/* Races of the journal */
+	int begin;			/* First race of the shard */
+	int end;			/* Race past the last one of the shard */
+	int id;				/* Index of the worker */
+	int32_t* winners;		/* Winning tickets of the shard, race after race */
+	long winner_count;		/* Number of winning tickets */
+	long capacity;			/* Tickets winners can hold */
+	uint8_t* hit;			/* Scratch column of matches */
+	int hit_capacity;		/* Tickets hit can hold */
+} bt_shard;
+
+typedef struct {
+	char name[MAX_NAME_LEN];	/* Name of the player */
+	long paid;			/* Payouts recorded by the server */
+	long alt;			/* Payouts under the tested rules */
+} bt_player;
+
+typedef struct {
+	bt_player* players;		/* Players seen in the journal */
+	int* slots;			/* Open-addressing table of indexes into players by name (-1 for empty) */
+	int count;			/* Number of players */
+	int capacity;			/* Size of the table, players holds half of it */
+} bt_names;
+
+typedef struct {
+	long races;			/* Races replayed */
+	long tickets;			/* Tickets replayed */
+	long stakes;			/* Money bet */
+	long paid;			/* Payouts recorded by the server */
+	long alt;			/* Payouts under the tested rules */
+	long take;			/* House take under the tested rules */
+	long breakage;			/* Rounding remainder kept by the house */
+	long topped;			/* Money the house added to reach minimum payouts */
+	long carry_paid;		/* Pools carried past the last race by the server */
+	long carry_alt;			/* Pools carried past the last race under the tested rules */
+	long breaks;			/* Races whose carry-over does not follow the previous race (restarts) */
+	long differ;			/* Tickets paid differently under the tested rules */
+} bt_report;
+
+void bt_usage(void) {
+	fprintf(stderr, "USAGE: backtest journal [take=percent] [min=percent] [round=unit] [breakage=carry|house] [workers=n]\n");
+}
+
+/*
+* Reads rules from name=value arguments, defaults are the rules of the server.
+*
+* Returns 0 on success, -1 on unknown or invalid arguments.
+*/
+int bt_read_rules(payout_rules* rules, int argc, char** argv) {
+	char* value;
+	int i;
+
+	memset(rules, 0, sizeof(payout_rules));
+	rules->unit = 1;
+	rules->workers = sysconf(_SC_NPROCESSORS_ONLN);
+	for(i = 0; i < argc; ++i) {
+		if( (value = strchr(argv[i], '=')) == NULL) {
+			return -1;
+		}
+		*value++ = '\0';
+		if(!strcmp(argv[i], "take")) {
+			rules->take_bp = (long) (strtod(value, NULL) * BT_BASIS_POINTS / 100 + 0.5);
+		} else if(!strcmp(argv[i], "min")) {
+			rules->min_pct = atol(value);
+		} else if(!strcmp(argv[i], "round")) {
+			rules->unit = atol(value);
+		} else if(!strcmp(argv[i], "breakage")) {
+			if(strcmp(value, "carry") && strcmp(value, "house")) {
+				return -1;
+			}
+			rules->breakage_house = !strcmp(value, "house");
+		} else if(!strcmp(argv[i], "workers")) {
+			rules->workers = atoi(value);
+		} else {
+			return -1;
+		}
+	}
+	if(rules->take_bp < 0 || rules->take_bp > BT_BASIS_POINTS || rules->min_pct < 0 || rules->unit < 1) {
+		return -1;
+	}
+	if(rules->workers < 1) {
+		rules->workers = 1;
+	}
+	if(rules->workers > SETTLE_MAX_WORKERS) {
+		rules->workers = SETTLE_MAX_WORKERS;
+	}
+	return 0;
+}
+
+/*
+* Checks an entry and its ticket columns before they are trusted as indexes.
+*
+* @left: bytes of the journal from the entry on
+* @cols: destination for length of the columns, padding included
+*
+* Returns 1 if the entry is whole and valid, 0 otherwise.
+*/
+int bt_valid(journal_entry* e, size_t left, size_t* cols) {
+	int32_t* player;
+	uint8_t* type;
+	int i, n;
+
+	if(e->magic != JOURNAL_MAGIC || (e->type != JOURNAL_PLAYER && e->type != JOURNAL_RACE) ||
+		(e->type == JOURNAL_PLAYER && (e->index < 0 || e->index >= MAX_PLAYERS)) || e->count < 0) {
+		return 0;
+	}
+	n = (e->type == JOURNAL_RACE) ? e->count : 0;
+	*cols = (size_t) n * (3 * sizeof(int32_t) + BET_PLACES * sizeof(int16_t) + sizeof(uint8_t));
+	*cols += (8 - *cols % 8) % 8;
+	if(sizeof(journal_entry) + *cols > left) {
+		return 0;
+	}
+	player = (int32_t*) (e + 1);
+	type = (uint8_t*) ((char*) player + n * (3 * sizeof(int32_t) + BET_PLACES * sizeof(int16_t)));
+	for(i = 0; i < n; ++i) {
+		if(player[i] < 0 || player[i] >= MAX_PLAYERS || type[i] >= BET_TYPES) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+* Walks entries of the mapped journal and lays out ticket columns of every race.
+* A damaged entry is skipped up to the next valid one, entries start on 8-byte boundaries.
+* A torn entry at the end, left by a server killed while writing, ends the walk.
+*
+* @entries: destination for all entries in journal order
+* @races:   destination for races in journal order
+*
+* Returns number of entries.
+*/
+long bt_index(char* map, size_t size, journal_entry*** entries, bt_race** races, long* race_count) {
+	long count = 0, capacity = 0, rcapacity = 0;
+	size_t off = 0, next, cols;
+	journal_entry* e;
+	bt_race* r;
+	char* col;
+	int i, n;
+
+	*entries = NULL;
+	*races = NULL;
+	*race_count = 0;
+	while(off + sizeof(journal_entry) <= size) {
+		e = (journal_entry*) (map + off);
+		if(!bt_valid(e, size - off, &cols)) {
+			for(next = off + 8; next + sizeof(journal_entry) <= size &&
+				!bt_valid((journal_entry*) (map + next), size - next, &cols); next += 8);
+			if(next + sizeof(journal_entry) > size) {
+				fprintf(stderr, "Journal ends inside an entry at byte %zu, ignoring it.\n", off);
+				break;
+			}
+			fprintf(stderr, "Damaged entry at byte %zu, resuming at byte %zu.\n", off, next);
+			off = next;
+			e = (journal_entry*) (map + off);
+		}
+		n = (e->type == JOURNAL_RACE) ? e->count : 0;
+		if(count == capacity) {
+			capacity = (capacity) ? 2 * capacity : BT_NAMES_MIN;
+			if( (*entries = (journal_entry**) realloc(*entries, capacity * sizeof(journal_entry*))) == NULL) {
+				ERR("realloc");
+			}
+		}
+		(*entries)[count++] = e;
+		if(e->type == JOURNAL_RACE) {
+			if(*race_count == rcapacity) {
+				rcapacity = (rcapacity) ? 2 * rcapacity : BT_NAMES_MIN;
+				if( (*races = (bt_race*) realloc(*races, rcapacity * sizeof(bt_race))) == NULL) {
+					ERR("realloc");
+				}
+			}
+			r = &(*races)[(*race_count)++];
+			memset(r, 0, sizeof(bt_race));
+			r->entry = e;
+			r->book.count = r->book.capacity = n;
+			col = (char*) (e + 1);
+			r->book.player = (int32_t*) col;
+			r->book.stake = (int32_t*) (col += n * sizeof(int32_t));
+			r->book.payout = (int32_t*) (col += n * sizeof(int32_t));
+			col += n * sizeof(int32_t);
+			for(i = 0; i < BET_PLACES; ++i) {
+				r->book.sel[i] = (int16_t*) col;
+				col += n * sizeof(int16_t);
+			}
+			r->book.type = (uint8_t*) col;
+			memcpy(r->book.pool, e->pools, sizeof(r->book.pool));
+		}
+		off += sizeof(journal_entry) + cols;
+	}
+	return count;
+}
+
+/*
+* Matches tickets of the shard's races with settle_match of the server and collects the winning ones.
+*/
+void* bt_match(void* arg) {
+	bt_shard* s = (bt_shard*) arg;
+	long stakes[BET_TYPES];
+	settle_chunk c;
+	bt_race* r;
+	int i, j, n;
+
+	for(j = s->begin; j < s->end; ++j) {
+		r = &s->races[j];
+		n = r->book.count;
+		if(n > s->hit_capacity) {
+			if( (s->hit = (uint8_t*) realloc(s->hit, n)) == NULL) {
+				ERR("realloc");
+			}
+			s->hit_capacity = n;
+		}
+		r->book.hit = s->hit;
+		c.book = &r->book;
+		c.begin = 0;
+		c.end = n;
+		memcpy(c.order, r->entry->order, sizeof(c.order));
+		settle_match(&c);
+		memcpy(r->won, c.won, sizeof(r->won));
+
+		stakes[BET_WIN] = stakes[BET_EXACTA] = stakes[BET_TRIFECTA] = 0;
+		for(i = 0; i < n; ++i) {
+			stakes[BET_WIN] += (r->book.type[i] == BET_WIN) * (long) r->book.stake[i];
+			stakes[BET_EXACTA] += (r->book.type[i] == BET_EXACTA) * (long) r->book.stake[i];
+			stakes[BET_TRIFECTA] += (r->book.type[i] == BET_TRIFECTA) * (long) r->book.stake[i];
+		}
+		memcpy(r->stakes, stakes, sizeof(stakes));
+
+		r->worker = s->id;
+		r->winners = s->winner_count;
+		for(i = 0; i < n; ++i) {
+			if(!s->hit[i]) {
+				continue;
+			}
+			if(s->winner_count == s->capacity) {
+				s->capacity = (s->capacity) ? 2 * s->capacity : BT_WINNERS_MIN;
+				if( (s->winners = (int32_t*) realloc(s->winners, s->capacity * sizeof(int32_t))) == NULL) {
+					ERR("realloc");
+				}
+			}
+			s->winners[s->winner_count++] = i;
+		}
+		r->winner_count = s->winner_count - r->winners;
+		r->book.hit = NULL;
+	}
+	return NULL;
+}
+
+/*
+* Splits races between workers by tickets and matches them in parallel.
+*/
+void bt_match_all(bt_race* races, long race_count, bt_shard* shards, int workers) {
+	pthread_t tids[SETTLE_MAX_WORKERS];
+	long total = 0, seen = 0;
+	int i, j = 0;
+
+	for(i = 0; i < race_count; ++i) {
+		total += races[i].book.count + 1;
+	}
+	for(i = 0; i < workers; ++i) {
+		memset(&shards[i], 0, sizeof(bt_shard));
+		shards[i].races = races;
+		shards[i].id = i;
+		shards[i].begin = j;
+		while(j < race_count && (i == workers - 1 || seen < total * (i + 1) / workers)) {
+			seen += races[j++].book.count + 1;
+		}
+		shards[i].end = j;
+	}
+	for(i = 1; i < workers; ++i) {
+		if(pthread_create(&tids[i], NULL, bt_match, &shards[i]) != 0) {
+			ERR("pthread_create");
+		}
+	}
+	bt_match(&shards[0]);
+	for(i = 1; i < workers; ++i) {
+		if(pthread_join(tids[i], NULL) != 0) {
+			ERR("pthread_join");
+		}
+	}
+}
+
+unsigned int bt_hash(char* name) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for(i = 0; i < MAX_NAME_LEN && name[i]; ++i) {
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h;
+}
+
+/*
+* Finds the player of the given name, adding a new one when needed.
+*
+* Returns index of the player in names->players.
+*/
+int bt_player_of(bt_names* names, char* name) {
+	unsigned int i;
+	int j, old;
+	int* slots;
+
+	if(2 * (names->count + 1) > names->capacity) {
+		old = names->capacity;
+		names->capacity = (old) ? 2 * old : BT_NAMES_MIN;
+		if( (names->players = (bt_player*) realloc(names->players, names->capacity / 2 * sizeof(bt_player))) == NULL ||
+			(slots = (int*) malloc(names->capacity * sizeof(int))) == NULL) {
+			ERR("malloc");
+		}
+		memset(slots, -1, names->capacity * sizeof(int));
+		for(j = 0; j < names->count; ++j) {
+			for(i = bt_hash(names->players[j].name) & (names->capacity - 1); slots[i] >= 0; i = (i + 1) & (names->capacity - 1));
+			slots[i] = j;
+		}
+		free(names->slots);
+		names->slots = slots;
+	}
+	for(i = bt_hash(name) & (names->capacity - 1); names->slots[i] >= 0; i = (i + 1) & (names->capacity - 1)) {
+		if(!strncmp(names->players[names->slots[i]].name, name, MAX_NAME_LEN)) {
+			return names->slots[i];
+		}
+	}
+	j = names->count++;
+	memset(&names->players[j], 0, sizeof(bt_player));
+	memcpy(names->players[j].name, name, MAX_NAME_LEN);
+	names->players[j].name[MAX_NAME_LEN - 1] = '\0';
+	names->slots[i] = j;
+	return j;
+}
+
+/*
+* Replays settlement of all races under the rules in journal order.
+* Pools carry over between races, so this pass is serial, but it only visits winning tickets.
+* Where the recorded carry-over does not follow from the previous race (a restart without
+* handing the state over), the tested pools restart from the recorded ones.
+*/
+void bt_replay(journal_entry** entries, long entry_count, bt_race* races, bt_shard* shards, payout_rules* rules, bt_names* names, bt_report* rep) {
+	long carry[BET_TYPES], expected[BET_TYPES], paid[BET_TYPES], alt[BET_TYPES], net[BET_TYPES];
+	long pay, least, take;
+	int slots[MAX_PLAYERS], chain = 0, i, t, pl;
+	char unknown[MAX_NAME_LEN];
+	int32_t* winners;
+	journal_entry* e;
+	bet_book* book;
+	bt_race* r;
+	long k, w;
+
+	memset(rep, 0, sizeof(bt_report));
+	memset(carry, 0, sizeof(carry));
+	memset(expected, 0, sizeof(expected));
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		slots[i] = -1;
+	}
+	r = races;
+	for(k = 0; k < entry_count; ++k) {
+		e = entries[k];
+		if(e->type == JOURNAL_PLAYER) {
+			slots[e->index] = bt_player_of(names, e->name);
+			continue;
+		}
+		book = &r->book;
+		for(t = 0; t < BET_TYPES && chain && e->pools[t] - r->stakes[t] == expected[t]; ++t);
+		if(t < BET_TYPES) {
+			for(t = 0; t < BET_TYPES; ++t) {
+				carry[t] = e->pools[t] - r->stakes[t];
+			}
+			rep->breaks += chain;
+			chain = 1;
+		}
+		for(t = 0; t < BET_TYPES; ++t) {
+			take = r->stakes[t] * rules->take_bp / BT_BASIS_POINTS;
+			net[t] = carry[t] + r->stakes[t] - take;
+			rep->take += take;
+			rep->stakes += r->stakes[t];
+			paid[t] = alt[t] = 0;
+		}
+		winners = shards[r->worker].winners + r->winners;
+		for(w = 0; w < r->winner_count; ++w) {
+			i = winners[w];
+			t = book->type[i];
+			pay = book->stake[i] * net[t] / r->won[t];
+			pay -= pay % rules->unit;
+			alt[t] += pay;
+			least = book->stake[i] * rules->min_pct / 100;
+			if(pay < least) {
+				rep->topped += least - pay;
+				pay = least;
+			}
+			paid[t] += book->payout[i];
+			rep->differ += (pay != book->payout[i]);
+			if( (pl = slots[book->player[i]]) < 0) {
+				snprintf(unknown, MAX_NAME_LEN, "slot %d", book->player[i]);
+				pl = slots[book->player[i]] = bt_player_of(names, unknown);
+			}
+			names->players[pl].paid += book->payout[i];
+			names->players[pl].alt += pay;
+			rep->paid += book->payout[i];
+			rep->alt += pay;
+		}
+		for(t = 0; t < BET_TYPES; ++t) {
+			expected[t] = e->pools[t] - paid[t];
+			if(r->won[t] > 0 && rules->breakage_house) {
+				rep->breakage += net[t] - alt[t];
+				carry[t] = 0;
+			} else {
+				carry[t] = net[t] - alt[t];
+			}
+		}
+		rep->tickets += book->count;
+		++rep->races;
+		++r;
+	}
+	for(t = 0; t < BET_TYPES; ++t) {
+		rep->carry_paid += expected[t];
+		rep->carry_alt += carry[t];
+	}
+}
+
+int bt_by_delta(const void* a, const void* b) {
+	const bt_player* x = (const bt_player*) a, *y = (const bt_player*) b;
+	long dx = x->alt - x->paid, dy = y->alt - y->paid;
+
+	return (dx > dy) - (dx < dy);
+}
+
+void bt_print(bt_names* names, bt_report* rep) {
+	bt_player* p;
+	int i;
+
+	qsort(names->players, names->count, sizeof(bt_player), bt_by_delta);
+	printf("%-16s %14s %14s %14s\n", "player", "recorded", "backtest", "delta");
+	for(i = 0; i < names->count; ++i) {
+		p = &names->players[i];
+		printf("%-16s %14ld %14ld %+14ld\n", p->name, p->paid, p->alt, p->alt - p->paid);
+	}
+	printf("\nhouse: races %ld, tickets %ld, stakes %ld\n", rep->races, rep->tickets, rep->stakes);
+	printf("  payouts recorded %ld, backtest %ld, house delta %+ld\n", rep->paid, rep->alt, rep->paid - rep->alt);
+	printf("  take %ld, breakage kept %ld, minimum payout top-ups %ld\n", rep->take, rep->breakage, rep->topped);
+	printf("  carried over recorded %ld, backtest %ld\n", rep->carry_paid, rep->carry_alt);
+	printf("  tickets paid differently %ld, carry-over breaks (restarts) %ld\n", rep->differ, rep->breaks);
+}
+
+int main(int argc, char** argv) {
+	bt_shard shards[SETTLE_MAX_WORKERS];
+	long entry_count, race_count, begin, matched;
+	journal_entry** entries;
+	payout_rules rules;
+	struct stat st;
+	bt_report rep;
+	bt_names names;
+	bt_race* races;
+	char* map;
+	int fd, i;
+
+	if(argc < 2 || bt_read_rules(&rules, argc - 2, argv + 2) < 0) {
+		bt_usage();
+		exit(EXIT_FAILURE);
+	}
+	if( (fd = TEMP_FAILURE_RETRY(open(argv[1], O_RDONLY | O_CLOEXEC))) < 0) {
+		ERR("open");
+	}
+	if(fstat(fd, &st) < 0) {
+		ERR("fstat");
+	}
+	if(st.st_size == 0) {
+		fprintf(stderr, "Journal is empty.\n");
+		exit(EXIT_FAILURE);
+	}
+	if( (map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		ERR("mmap");
+	}
+	if(TEMP_FAILURE_RETRY(close(fd)) < 0) {
+		ERR("close");
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	begin = monotonic_ns();
+	entry_count = bt_index(map, st.st_size, &entries, &races, &race_count);
+	bt_match_all(races, race_count, shards, rules.workers);
+	matched = monotonic_ns();
+	memset(&names, 0, sizeof(bt_names));
+	bt_replay(entries, entry_count, races, shards, &rules, &names, &rep);
+	fprintf(stderr, "Matched %ld tickets of %ld races on %d workers in %ld ms, replayed in %ld ms.\n",
+		rep.tickets, rep.races, rules.workers, (matched - begin) / 1000000, (monotonic_ns() - matched) / 1000000);
+	bt_print(&names, &rep);
+
+	for(i = 0; i < rules.workers; ++i) {
+		free(shards[i].winners);
+		free(shards[i].hit);
+	}
+	free(names.players);
+	free(names.slots);
+	free(races);
+	free(entries);
+	munmap(map, st.st_size);
+	return EXIT_SUCCESS;
+}
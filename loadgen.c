@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BUF_SIZE 65536
+#define INFO_CMD "i\r\n"
+#define INFO_REPLY "Player: "
+
+#define ERR(source) (perror(source),\
+		fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
+		exit(EXIT_FAILURE))
+
+typedef struct {
+	int socket;			/* Connection to the server */
+	double sent_at;			/* Time the outstanding command was sent */
+} client;
+
+void usage(void) {
+	fprintf(stderr, "USAGE: loadgen port|unix_path clients seconds [command reply_prefix]\n");
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+* Connects to the server port on loopback, or to its unix socket when
+* the target is a path ("@name" for the abstract namespace).
+*/
+int connect_client(const char* target) {
+	struct sockaddr_storage addr;
+	struct sockaddr_in* in = (struct sockaddr_in*) &addr;
+	struct sockaddr_un* un = (struct sockaddr_un*) &addr;
+	socklen_t len;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	if(target[0] == '/' || target[0] == '@') {
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, target, sizeof(un->sun_path) - 1);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(un->sun_path);
+		if(target[0] == '@') {
+			un->sun_path[0] = '\0';
+		} else {
+			++len;
+		}
+	} else {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(atoi(target));
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(struct sockaddr_in);
+	}
+	if( (sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) {
+		ERR("socket");
+	}
+	/* Listen backlog of the server is short, retry while it drains */
+	while(connect(sock, (struct sockaddr*) &addr, len) < 0) {
+		if(errno != ECONNREFUSED && errno != EAGAIN) {
+			ERR("connect");
+		}
+		if(TEMP_FAILURE_RETRY(close(sock)) < 0) {
+			ERR("close");
+		}
+		if( (sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) {
+			ERR("socket");
+		}
+		usleep(1000);
+	}
+	return sock;
+}
+
+void send_cmd(client* cl, const char* cmd) {
+	if(TEMP_FAILURE_RETRY(write(cl->socket, cmd, strlen(cmd))) < 0) {
+		ERR("write");
+	}
+	cl->sent_at = now();
+}
+
+int cmp_double(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+/*
+* Synthetic load shared by all session backends: every client logs in
+* and keeps exactly one command (info by default) outstanding, while race
+* turns are broadcast by the server in the background.
+*/
+int main(int argc, char** argv) {
+	int clients, seconds, i, j, count, ready;
+	long replies = 0, lat_count = 0, lat_cap = 1 << 20;
+	long long bytes = 0;
+	double start, end, *lat;
+	char* buf, name[32], cmd[32];
+	const char* reply = INFO_REPLY;
+	client* cls;
+	struct pollfd* fds;
+
+	if(argc != 4 && argc != 6) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	clients = atoi(argv[2]);
+	seconds = atoi(argv[3]);
+	strcpy(cmd, INFO_CMD);
+	if(argc == 6) {
+		snprintf(cmd, sizeof(cmd), "%s\r\n", argv[4]);
+		reply = argv[5];
+	}
+
+	if( (cls = (client*) calloc(clients, sizeof(client))) == NULL ||
+		(fds = (struct pollfd*) calloc(clients, sizeof(struct pollfd))) == NULL ||
+		(lat = (double*) malloc(lat_cap * sizeof(double))) == NULL ||
+		(buf = (char*) malloc(BUF_SIZE)) == NULL) {
+		ERR("malloc");
+	}
+
+	for(i = 0; i < clients; ++i) {
+		cls[i].socket = connect_client(argv[1]);
+		fds[i].fd = cls[i].socket;
+		fds[i].events = POLLIN;
+	}
+
+	/* Server reads login with a single read, let it arrive before the first command */
+	for(i = 0, ready = 0; ready < clients; ++i) {
+		if(TEMP_FAILURE_RETRY(read(cls[i].socket, buf, BUF_SIZE - 1)) <= 0) {
+			ERR("read");
+		}
+		snprintf(name, sizeof(name), "load%d\r\n", i);
+		send_cmd(&cls[i], name);
+		++ready;
+	}
+	usleep(100000);
+	for(i = 0; i < clients; ++i) {
+		send_cmd(&cls[i], cmd);
+	}
+
+	start = now();
+	end = start + seconds;
+	while(now() < end) {
+		if( (ready = poll(fds, clients, 100)) < 0) {
+			if(errno == EINTR) continue;
+			ERR("poll");
+		}
+		for(i = 0; i < clients && ready > 0; ++i) {
+			if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			--ready;
+			if( (count = TEMP_FAILURE_RETRY(read(fds[i].fd, buf, BUF_SIZE - 1))) <= 0) {
+				fprintf(stderr, "Client %d disconnected.\n", i);
+				fds[i].fd = -1;
+				continue;
+			}
+			bytes += count;
+			for(j = 0; j < count; ++j) {
+				if(buf[j] == '\0') buf[j] = ' ';
+			}
+			buf[count] = '\0';
+			if(strstr(buf, reply)) {
+				if(lat_count < lat_cap) {
+					lat[lat_count++] = now() - cls[i].sent_at;
+				}
+				++replies;
+				send_cmd(&cls[i], cmd);
+			}
+		}
+	}
+	end = now() - start;
+
+	qsort(lat, lat_count, sizeof(double), cmp_double);
+	printf("clients: %d, seconds: %.1f\n", clients, end);
+	printf("commands: %ld (%.0f/s), received: %.1f MB\n", replies, replies / end, bytes / 1e6);
+	if(lat_count > 0) {
+		printf("latency us: p50 %.0f, p99 %.0f, max %.0f\n", lat[lat_count / 2] * 1e6, lat[lat_count * 99 / 100] * 1e6, lat[lat_count - 1] * 1e6);
+	}
+
+	for(i = 0; i < clients; ++i) {
+		close(cls[i].socket);
+	}
+	free(cls);
+	free(fds);
+	free(lat);
+	free(buf);
+	return EXIT_SUCCESS;
+}
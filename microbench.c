@@ -0,0 +1,372 @@
+/*
+* In-process microbenchmarks of the code run on every race turn and command.
+* The server is compiled into the benchmark, its main is renamed away.
+*/
+#define main server_main
+#include "server.c"
+#undef main
+
+#define BENCH_MIN_NS 200000000L
+#define BENCH_MAX_ITERS 100000000L
+#define BENCH_MONEY 1000000000
+#define BENCH_BET 10
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+unsigned long alloc_count = 0;
+
+void* malloc(size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+typedef struct {
+	long iters;			/* Operations to run */
+	long ns;			/* Time spent in timed sections */
+	unsigned long allocs;		/* Allocations made in timed sections */
+	long started;			/* Start of the running timed section */
+	unsigned long allocs_started;	/* Allocation count at start of the running timed section */
+} bench;
+
+typedef struct {
+	horse* horses;			/* Stable of the track */
+	int horse_count;		/* Number of horses */
+	horse* field[MAX_HORSES_PER_RACE];	/* Horses of the upcoming race */
+	horse* winner;			/* Winner of the last race */
+	player** players;		/* Registered players */
+	int player_count;		/* Number of players */
+	int bank;			/* Money in the bank */
+	int state;			/* State of the server */
+	time_t count_start;		/* Start of the betting window */
+	int interval;			/* Length of the betting window */
+	pthread_mutex_t bank_mutex;	/* Mutex for bank access */
+	bet_book book;			/* Tickets of the upcoming race */
+	race_template tmpl;		/* Static parts of replies about the upcoming race */
+	race_snapshots snapshots;	/* Published next and last race replies */
+	rate_limiter limiter;		/* Rate limits, all disabled */
+	server_metrics metrics;		/* Server counters */
+	track_export export;		/* Disabled shared-memory export */
+	player_th_data session;		/* Session commands are routed through */
+	const char* cmd;		/* Command of route_cmd cases */
+} track;
+
+typedef struct {
+	const char* name;		/* Name of the case */
+	void (*fn)(bench*, track*);	/* Runs b->iters operations */
+	int players;			/* Players registered on the track */
+	int horses;			/* Horses in the stable */
+	const char* cmd;		/* Command of route_cmd cases */
+} bench_case;
+
+void bench_start(bench* b) {
+	b->allocs_started = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+	b->started = monotonic_ns();
+}
+
+void bench_stop(bench* b) {
+	b->ns += monotonic_ns() - b->started;
+	b->allocs += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - b->allocs_started;
+}
+
+/*
+* Builds a track with the given stable and players, one session logged in as the first player.
+*/
+void track_init(track* t, int horse_count, int player_count) {
+	server_conf conf;
+	int i;
+
+	memset(t, 0, sizeof(track));
+	t->horse_count = horse_count;
+	t->player_count = player_count;
+	t->interval = 60;
+	t->state = STATE_NOT_RACING;
+	t->count_start = time(NULL);
+	if( (t->horses = (horse*) calloc(horse_count, sizeof(horse))) == NULL ||
+		(t->players = (player**) calloc(player_count, sizeof(player*))) == NULL) {
+		ERR("calloc");
+	}
+	for(i = 0; i < horse_count; ++i) {
+		snprintf(t->horses[i].name, MAX_NAME_LEN, "kon%d", i + 1);
+		t->horses[i].rest_factor = 1;
+	}
+	for(i = 0; i < player_count; ++i) {
+		if( (t->players[i] = (player*) calloc(1, sizeof(player))) == NULL) {
+			ERR("calloc");
+		}
+		snprintf(t->players[i]->name, MAX_NAME_LEN, "p%d", i);
+		t->players[i]->money = BENCH_MONEY;
+		t->players[i]->bank = &t->bank;
+	}
+	if(pthread_mutex_init(&t->bank_mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
+	}
+	snapshot_init(&t->snapshots, &t->tmpl, &t->count_start, &t->interval, &t->winner);
+	for(i = 0; i < MAX_HORSES_PER_RACE && i < horse_count; ++i) {
+		t->field[i] = &t->horses[i];
+	}
+	publish_field(&t->snapshots, t->field);
+	t->winner = &t->horses[0];
+	publish_snapshot(&t->snapshots);
+
+	default_conf(&conf);
+	conf.cmd.rate = conf.bet.rate = conf.ip_cmd.rate = conf.ip_bet.rate = 0;
+	rate_limiter_init(&t->limiter, &conf);
+
+	t->session.players = t->players;
+	t->session.index = 0;
+	if( (t->session.socket = open("/dev/null", O_WRONLY)) < 0) {
+		ERR("open");
+	}
+	t->session.state = &t->state;
+	t->session.bank = &t->bank;
+	t->session.horse_count = horse_count;
+	t->session.time = &t->count_start;
+	t->session.interval = &t->interval;
+	t->session.horses = t->horses;
+	t->session.bank_mutex = &t->bank_mutex;
+	t->session.winner = &t->winner;
+	t->session.book = &t->book;
+	t->session.tmpl = &t->tmpl;
+	t->session.snapshots = &t->snapshots;
+	t->session.limiter = &t->limiter;
+	t->session.metrics = &t->metrics;
+	t->session.export = &t->export;
+}
+
+void track_destroy(track* t) {
+	int i;
+
+	if(TEMP_FAILURE_RETRY(close(t->session.socket)) < 0) {
+		ERR("close");
+	}
+	rate_limiter_destroy(&t->limiter);
+	snapshot_destroy(&t->snapshots);
+	book_destroy(&t->book);
+	pthread_mutex_destroy(&t->bank_mutex);
+	for(i = 0; i < t->player_count; ++i) {
+		free(t->players[i]);
+	}
+	free(t->players);
+	free(t->horses);
+}
+
+/*
+* One operation is one turn of one horse.
+*/
+void bench_horse_step(bench* b, track* t) {
+	long i, ops = 0;
+	int j;
+
+	bench_start(b);
+	for(i = 0; ops < b->iters; ++i) {
+		for(j = 0; j < t->horse_count && ops < b->iters; ++j, ++ops) {
+			horse_step(&t->horses[j]);
+			if(t->horses[j].distance_run >= RACE_DISTANCE) {
+				t->horses[j].distance_run = 0;
+				t->horses[j].rest_factor = 1;
+			}
+		}
+	}
+	bench_stop(b);
+}
+
+void bench_draw_field(bench* b, track* t) {
+	unsigned int seed = 1;
+	long i;
+	int j, count;
+
+	bench_start(b);
+	for(i = 0; i < b->iters; ++i) {
+		count = draw_field(t->horses, t->horse_count, t->field, &seed);
+		for(j = 0; j < count; ++j) {
+			t->field[j]->running = 0;
+		}
+	}
+	bench_stop(b);
+}
+
+/*
+* One operation settles a race in which every player holds a ticket,
+* win, exacta and trifecta tickets in turn on random distinct horses.
+*/
+void bench_manage_prizes(bench* b, track* t) {
+	unsigned int seed = 1;
+	int16_t order[BET_PLACES] = {0, 1, 2}, sel[BET_PLACES];
+	long i;
+	int j, k, type;
+
+	for(i = 0; i < b->iters; ++i) {
+		for(j = 0; j < t->player_count; ++j) {
+			type = j % BET_TYPES;
+			for(k = 0; k <= type; ++k) {
+				sel[k] = rand_r(&seed) % MAX_HORSES_PER_RACE;
+				if(k > 0 && sel[k] == sel[0]) {
+					sel[k] = (sel[k] + 1) % MAX_HORSES_PER_RACE;
+				}
+				if(k > 1 && sel[k] == sel[1]) {
+					sel[k] = (sel[k] + 1) % MAX_HORSES_PER_RACE;
+					sel[k] = (sel[k] == sel[0]) ? (sel[k] + 1) % MAX_HORSES_PER_RACE : sel[k];
+				}
+			}
+			t->players[j]->horse_bet = t->field[sel[0]];
+			t->players[j]->money_bet = BENCH_BET;
+			book_add(&t->book, j, type, sel, BENCH_BET);
+			t->bank += BENCH_BET;
+		}
+		bench_start(b);
+		manage_prizes(&t->bank, t->players, order, &t->book, &t->bank_mutex, NULL, NULL);
+		bench_stop(b);
+	}
+}
+
+void bench_render_race_status(bench* b, track* t) {
+	char buf[LINE_BUF * MAX_HORSES_PER_RACE];
+	volatile size_t len;
+	long i;
+
+	bench_start(b);
+	for(i = 0; i < b->iters; ++i) {
+		t->tmpl.horses[i % t->tmpl.count]->distance_run = i % RACE_DISTANCE;
+		len = render_race_status(buf, sizeof(buf), &t->tmpl, NULL);
+	}
+	bench_stop(b);
+	(void) len;
+}
+
+void bench_render_info(bench* b, track* t) {
+	char buf[LINE_BUF];
+	volatile size_t len;
+	long i;
+
+	bench_start(b);
+	for(i = 0; i < b->iters; ++i) {
+		len = render_info(buf, LINE_BUF, t->players[i % t->player_count]);
+	}
+	bench_stop(b);
+	(void) len;
+}
+
+void bench_get_value(bench* b, track* t) {
+	char buf[BUF_SIZE];
+	volatile int value;
+	long i;
+
+	strcpy(buf, "d 123456");
+	bench_start(b);
+	for(i = 0; i < b->iters; ++i) {
+		value = get_value(buf);
+	}
+	bench_stop(b);
+	(void) value;
+}
+
+/*
+* One operation routes the case command of the next player, replies go to /dev/null.
+*/
+void bench_route_cmd(bench* b, track* t) {
+	char buf[BUF_SIZE];
+	size_t len = strlen(t->cmd) + 1;
+	long i;
+
+	bench_start(b);
+	for(i = 0; i < b->iters; ++i) {
+		t->session.index = i % t->player_count;
+		memcpy(buf, t->cmd, len);
+		route_cmd(&t->session, buf);
+	}
+	bench_stop(b);
+}
+
+bench_case cases[] = {
+	{"horse_step", bench_horse_step, 1, 8, NULL},
+	{"horse_step", bench_horse_step, 1, 1000, NULL},
+	{"draw_field", bench_draw_field, 1, 8, NULL},
+	{"draw_field", bench_draw_field, 1, 1000, NULL},
+	{"manage_prizes", bench_manage_prizes, 1000, 8, NULL},
+	{"manage_prizes", bench_manage_prizes, 100000, 8, NULL},
+	{"manage_prizes", bench_manage_prizes, 1000000, 8, NULL},
+	{"render_race_status", bench_render_race_status, 1, 8, NULL},
+	{"render_info", bench_render_info, 1000, 8, NULL},
+	{"render_info", bench_render_info, 1000000, 8, NULL},
+	{"get_value", bench_get_value, 1, 8, NULL},
+	{"route_cmd", bench_route_cmd, 1000, 8, "i"},
+	{"route_cmd", bench_route_cmd, 1000000, 8, "i"},
+	{"route_cmd", bench_route_cmd, 1000, 8, "n"},
+	{"route_cmd", bench_route_cmd, 1000, 8, "l"},
+	{"route_cmd", bench_route_cmd, 1000, 8, "d 10"},
+	{"route_cmd", bench_route_cmd, 1000, 8, "b kon1 10"},
+	{"route_cmd", bench_route_cmd, 1000000, 8, "b kon1 10"},
+	{"route_cmd", bench_route_cmd, 1000000, 8, "b kon1 kon2 kon3 10"},
+	{"route_cmd", bench_route_cmd, 1000, 1000, "b kon1000 10"},
+	{"route_cmd", bench_route_cmd, 1000000, 1000, "b kon1000 10"},
+};
+
+/*
+* Grows the number of operations until a case runs for BENCH_MIN_NS, then reports it.
+*/
+void run_case(bench_case* c) {
+	char name[64];
+	bench b;
+	track t;
+
+	track_init(&t, c->horses, c->players);
+	t.cmd = c->cmd;
+	b.iters = 1;
+	while(1) {
+		b.ns = 0;
+		b.allocs = 0;
+		c->fn(&b, &t);
+		if(b.ns >= BENCH_MIN_NS || b.iters >= BENCH_MAX_ITERS) {
+			break;
+		}
+		/* Aim past the minimum from the rate measured so far */
+		b.iters = (b.ns > 0) ? b.iters * 1.2 * BENCH_MIN_NS / b.ns + 1 : b.iters * 100;
+		if(b.iters > BENCH_MAX_ITERS) {
+			b.iters = BENCH_MAX_ITERS;
+		}
+	}
+	track_destroy(&t);
+
+	if(c->cmd) {
+		snprintf(name, sizeof(name), "%s \"%s\"", c->name, c->cmd);
+	} else {
+		snprintf(name, sizeof(name), "%s", c->name);
+	}
+	fprintf(stderr, "%-28s players %7d horses %4d %12.1f ns/op %9.4f allocs/op (%ld ops)\n",
+		name, c->players, c->horses, (double) b.ns / b.iters, (double) b.allocs / b.iters, b.iters);
+}
+
+void bench_usage(void) {
+	fprintf(stderr, "USAGE: microbench [case_name]\n");
+}
+
+int main(int argc, char** argv) {
+	unsigned int i;
+
+	if(argc > 2) {
+		bench_usage();
+		exit(EXIT_FAILURE);
+	}
+	/* Debug output of commands is part of their cost, but not of the report */
+	if(freopen("/dev/null", "w", stdout) == NULL) {
+		ERR("freopen");
+	}
+	for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		if(argc == 1 || !strcmp(argv[1], cases[i].name)) {
+			run_case(&cases[i]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
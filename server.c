@@ -9,12 +9,26 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
 #include <limits.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include "track_shm.h"
 
-#define BACKLOG 5
+#define BACKLOG 128
 #define BUF_SIZE 32
 #define MAX_NAME_LEN 16
 #define LINE_BUF 256
@@ -26,6 +40,80 @@
 #define STATE_NOT_RACING 101
 #define STATE_RACING 102
 
+#define IO_BACKEND_THREADS 201
+#define IO_BACKEND_URING 202
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 1024
+#define URING_BUF_GROUP 0
+#define URING_TAG_PROBE 0
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_RECV 2
+#define URING_TAG_SEND 3
+#define URING_TAG_TICK 4
+#define URING_TAG_ACK 5
+#define URING_TAG_PARK 6
+#define URING_TAG_MASK 7
+
+#define POOL_SESSIONS 0
+#define POOL_PLAYERS 1
+#define POOL_SENDS 2
+#define POOL_COUNT 3
+#define POOL_SLAB_SIZE 65536
+#define POOL_CACHE_BATCH 32
+#define POOL_CACHE_MAX 64
+#define BET_WIN 0
+#define BET_EXACTA 1
+#define BET_TRIFECTA 2
+#define BET_TYPES 3
+#define BET_PLACES 3
+#define BOOK_MIN_CAPACITY 4096
+#define SETTLE_CHUNK 65536
+#define SETTLE_MAX_WORKERS 16
+#define SNAPSHOT_SLOTS 4
+#define SNAPSHOT_CLAIMED (INT_MIN / 2)
+#define RATE_IP_BITS 16
+#define RATE_IP_SLOTS (1 << RATE_IP_BITS)
+#define RATE_IP_LOCKS 64
+
+#define ROLE_RACE 0
+#define ROLE_IO 1
+#define ROLE_ACCEPT 2
+#define ROLE_STATE 3
+#define ROLE_COUNT 4
+#define NSEC_PER_SEC 1000000000L
+#define TRACE_NAME_LEN 32
+#define TRACE_REQUEST_FILE "trace.req"
+#define HANDOFF_MAGIC 0x48525336
+#define HANDOFF_PATH_LEN 108
+#define LOCAL_MAX_UIDS 16
+#define REPLICA_RESET 1
+#define REPLICA_HORSE 2
+#define REPLICA_PLAYER 3
+#define REPLICA_MONEY 4
+#define REPLICA_BET 5
+#define REPLICA_FIELD 6
+#define REPLICA_COUNTDOWN 7
+#define REPLICA_TICK 8
+#define REPLICA_SETTLE 9
+#define REPLICA_SYNC 10
+#define REPLICA_END 11
+#define REPLICA_BATCH 1024
+#define REPLICA_QUEUE_LIMIT (256 << 20)
+#define REPLICA_ACK_MS 5
+#define REPLICA_CHUNK (REPLICA_BATCH * sizeof(replica_record))
+#define REPLICA_END_WAIT_MS 1000
+#define REPLICA_RETRY_MS 100
+#define REPLICA_RETRIES 30
+#define JOURNAL_MAGIC 0x4a524e32
+#define JOURNAL_PLAYER 1
+#define JOURNAL_RACE 2
+#define TICK_RING_SLOTS 64
+#define TOKEN_SLOT_SHIFT 56
+#define BIND_RETRY_MS 5
+#define BIND_RETRIES 200
+#define MONEY_LIMIT INT32_MAX
+
 #define SERVER_CONF_FILE "conf"
 
 #define ENTER_LOGIN_MSG "[SERVER MESSAGE] Enter login please:\n"
@@ -35,6 +123,29 @@
 #define CANT_BET_MSG "[SERVER MESSAGE] Not enough money to bet!\n"
 #define CANT_BET_NEGATIVE_MSG "[SERVER MESSAGE] Your bet must be more than zero!\n"
 #define CANT_DEP_NEGATIVE_MSG "[SERVER MESSAGE] Cannot deposit negative amount!\n"
+#define CANT_DEP_LIMIT_MSG "[SERVER MESSAGE] The track cannot hold that much money!\n"
+#define RATE_LIMITED_MSG "[SERVER MESSAGE] Too many commands, slow down!\n"
+#define BAD_BET_MSG "[SERVER MESSAGE] Bet on one to three different horses!\n"
+#define RESUME_TOKEN_MSG "[SERVER MESSAGE] Resume token: "
+#define RESUMED_MSG "[SERVER MESSAGE] Welcome back!\n"
+#define BAD_TOKEN_MSG "[SERVER MESSAGE] Unknown resume token, enter login please:\n"
+#define RESUME_CMD "resume "
+
+#define NEXT_RACE_PREFIX "Next race in "
+#define NEXT_RACE_SUFFIX " seconds...\n"
+#define NEXT_RACE_FIELD "Horses running in the next race:\n"
+#define DISTANCE_INFIX " dinstance: "
+#define LAST_WINNER_PREFIX "Last race winner: "
+#define INFO_PREFIX "Player: "
+#define INFO_MONEY ", money: "
+#define INFO_BET ", Bet on horse: "
+#define INFO_BET_MONEY " with "
+#define INFO_SUFFIX " money\n"
+#define STRLEN(literal) (sizeof(literal) - 1)
+
+#if TRACK_SHM_HORSES != MAX_HORSES_PER_RACE || TRACK_SHM_NAME_LEN != MAX_NAME_LEN
+#error "track_shm.h layout does not match the race limits"
+#endif
 
 #define ERR(source) (perror(source),\
 		fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
@@ -53,22 +164,272 @@ typedef struct {
 	float rest_factor;		/* Horse rest factor */
 } horse;
 
+typedef struct pool_obj {
+	struct pool_obj* next;		/* Next free object */
+} pool_obj;
+
+typedef struct {
+	size_t obj_size;		/* Size of one object */
+	size_t slab_objs;		/* Number of objects carved from one slab */
+	pool_obj* free;			/* Objects not cached by any thread */
+	void* slabs;			/* Allocated slabs, linked through their first word */
+	pthread_mutex_t mutex;		/* Mutex guarding free list and slabs */
+} pool;
+
+typedef struct {
+	pool_obj* free;			/* Objects cached by the thread */
+	int count;			/* Number of cached objects */
+} pool_cache;
+
+typedef struct {
+	int count;			/* Number of tickets */
+	int capacity;			/* Tickets the columns can hold */
+	int32_t* player;		/* Index of the betting player */
+	uint8_t* type;			/* Bet type (BET_WIN, BET_EXACTA or BET_TRIFECTA) */
+	int16_t* sel[BET_PLACES];	/* Horses picked for first to third place (-1 for places the type leaves open) */
+	int32_t* stake;			/* Money bet */
+	uint8_t* hit;			/* Settlement: ticket matches the finish order */
+	int32_t* payout;		/* Settlement: money won by the ticket */
+	int64_t pool[BET_TYPES];	/* Money in the pool of every bet type, including carry-over */
+} bet_book;
+
+typedef struct {
+	bet_book* book;			/* Book being settled */
+	int begin;			/* First ticket of the chunk */
+	int end;			/* Ticket past the last one of the chunk */
+	int16_t order[BET_PLACES];	/* Indexes of horses finishing first to third (-1 if nobody) */
+	long won[BET_TYPES];		/* Stakes of matching tickets, of the chunk after matching and of the book when paying */
+} settle_chunk;
+
+/*
+* Entry of the bet journal. A JOURNAL_RACE entry is followed by its ticket columns:
+* player, stake and payout (int32_t), picks for first to third place (int16_t) and
+* bet type (uint8_t), each count long, zero-padded to a multiple of 8 bytes.
+*/
+typedef struct {
+	uint32_t magic;			/* JOURNAL_MAGIC */
+	int32_t type;			/* JOURNAL_PLAYER or JOURNAL_RACE */
+	int32_t index;			/* Slot of the player (JOURNAL_PLAYER) */
+	int32_t count;			/* Number of tickets in the columns following (JOURNAL_RACE) */
+	int64_t time;			/* Time the entry was written */
+	int64_t pools[BET_TYPES];	/* Pools by bet type before payouts, carry-over included (JOURNAL_RACE) */
+	int16_t order[BET_PLACES];	/* Indexes of horses finishing first to third, -1 if nobody (JOURNAL_RACE) */
+	char name[MAX_NAME_LEN];	/* Name of the player (JOURNAL_PLAYER) */
+} journal_entry;
+
+typedef struct {
+	int fd;				/* Journal file (-1 when the journal is disabled) */
+	char named[MAX_PLAYERS];	/* Name of the player slot was written by this process (==1 if so) */
+} bet_journal;
+
+typedef struct {
+	uint64_t seq;			/* Number of the turn across races */
+	size_t len;			/* Length of the rendered status */
+	char buf[LINE_BUF * MAX_HORSES_PER_RACE];	/* Race status as broadcast after the turn */
+} tick_entry;
+
+typedef struct {
+	tick_entry slots[TICK_RING_SLOTS];	/* Last turns, turn seq is kept in slot seq % TICK_RING_SLOTS */
+	uint64_t seq;			/* Turns recorded */
+	uint64_t race_first;		/* First turn of the race in progress */
+	short racing;			/* A race is in progress (==1 if so) */
+	pthread_mutex_t mutex;		/* Mutex guarding the ring */
+} tick_ring;
+
 typedef struct {
 	char name[MAX_NAME_LEN];	/* Player's name */
 	int money;			/* Player's deposited money */
-	horse* horse_bet;		/* Pointer to betted horse */
-	int money_bet;			/* Money betted on horse */
+	horse* horse_bet;		/* Pointer to horse picked first on the last ticket */
+	int money_bet;			/* Stake of the last ticket */
 	int* bank;			/* Pointer to bank */
+	uint64_t token;			/* Secret sessions resume the player with, slot in the top byte */
 } player;
 
+typedef struct server_metrics server_metrics;
+
 typedef struct {
 	horse* horse_data;		/* Horse owned by thread */
 	horse** winner;			/* Pointer to winner of the race */
+	server_metrics* metrics;	/* Server counters */
 } horse_args;
 
 typedef struct {
+	horse* horses[MAX_HORSES_PER_RACE];	/* Horses of the field in rendering order */
+	int count;			/* Number of horses in the field */
+	char field[MAX_HORSES_PER_RACE * (MAX_NAME_LEN + 2) + STRLEN(NEXT_RACE_FIELD) + 1];	/* Rendered list of the field for next race info */
+	size_t field_len;		/* Length of rendered field list */
+	char prefix[MAX_HORSES_PER_RACE][MAX_NAME_LEN + STRLEN(DISTANCE_INFIX)];	/* Rendered "<name> dinstance: " of every horse */
+	size_t prefix_len[MAX_HORSES_PER_RACE];	/* Lengths of rendered prefixes */
+} race_template;
+
+typedef struct {
+	int refs;			/* Readers using the snapshot, negative while it is being rebuilt */
+	time_t next_start;		/* Time the upcoming race starts */
+	char next_tail[STRLEN(NEXT_RACE_SUFFIX) + sizeof(((race_template*) 0)->field)];	/* Rendered next race info following the countdown */
+	size_t next_tail_len;		/* Length of next_tail */
+	char last[LINE_BUF];		/* Rendered last race info (empty before first race) */
+	size_t last_len;		/* Length of last */
+} race_snapshot;
+
+typedef struct {
+	race_snapshot slots[SNAPSHOT_SLOTS];	/* Storage recycled by snapshots */
+	race_snapshot* current;		/* Published snapshot (NULL when none could be built) */
+	pthread_mutex_t mutex;		/* Mutex serializing publishers */
+	race_template* tmpl;		/* Static parts of replies about the upcoming race */
+	time_t* count_start;		/* Time of interval between races start */
+	int* interval;			/* Interval of time between races */
+	horse** winner;			/* Pointer to winner of the race */
+} race_snapshots;
+
+typedef struct {
+	char* buf;			/* Destination buffer */
+	size_t len;			/* Bytes written so far */
+	size_t cap;			/* Size of the destination buffer */
+} resp_builder;
+
+typedef struct {
+	double rate;			/* Tokens added per second (0 disables the limit) */
+	double burst;			/* Bucket capacity */
+} rate_limit;
+
+typedef struct {
+	double tokens;			/* Tokens left */
+	double last;			/* Time of last refill */
+} token_bucket;
+
+typedef struct {
+	in_addr_t ip;			/* Address owning the slot */
+	token_bucket cmd;		/* Commands sent from the address */
+	token_bucket bet;		/* Bets sent from the address */
+} rate_ip_entry;
+
+typedef struct {
+	rate_limit cmd;			/* Commands per session */
+	rate_limit bet;			/* Bets per session */
+	rate_limit ip_cmd;		/* Commands per client address */
+	rate_limit ip_bet;		/* Bets per client address */
+	rate_ip_entry* ips;		/* Buckets of client addresses, direct mapped by address hash */
+	pthread_mutex_t locks[RATE_IP_LOCKS];	/* Mutexes striped over address buckets */
+} rate_limiter;
+
+typedef struct {
+	const char* name;		/* Name of the event (string literal) */
+	long begin;			/* Start of the event (CLOCK_MONOTONIC ns) */
+	long end;			/* End of the event (CLOCK_MONOTONIC ns) */
+	int race;			/* Race the event happened in */
+} trace_event;
+
+typedef struct trace_ring {
+	struct trace_ring* next;	/* Next ring of the tracer */
+	int id;				/* Thread id shown in the trace */
+	short alive;			/* Tells whether owning thread still runs (==1 if so) */
+	char name[TRACE_NAME_LEN];	/* Thread name shown in the trace */
+	unsigned long head;		/* Number of events recorded, written only by the owner */
+	trace_event* events;		/* Last events of the thread */
+} trace_ring;
+
+typedef struct {
+	short enabled;			/* Tells whether events are recorded (==1 if so) */
+	unsigned long size;		/* Events kept per thread (power of two) */
+	int race;			/* Number of the current/upcoming race */
+	int dumps;			/* Number of dumps written */
+	int ring_count;			/* Number of rings ever handed out */
+	trace_ring* rings;		/* Rings of all threads that recorded events */
+	pthread_mutex_t mutex;		/* Mutex guarding rings list and dumps */
+} tracer;
+
+typedef struct {
+	unsigned long wakeups;		/* Wakeups measured */
+	unsigned long total_ns;		/* Sum of wakeup latencies */
+	unsigned long max_ns;		/* Worst wakeup latency */
+} sched_stats;
+
+struct server_metrics {
+	unsigned long commands;		/* Commands accepted for execution */
+	unsigned long rejected_cmds;	/* Commands dropped by rate limits */
+	unsigned long rejected_bets;	/* Bets dropped by rate limits */
+	unsigned long rejected_peers;	/* Local connections refused by credential checks */
+	unsigned long resumes;		/* Sessions reattached to their player with a resume token */
+	sched_stats replica_acks;	/* Time bets waited for the standby to apply them */
+	unsigned long replica_timeouts;	/* Bets that stopped waiting for the standby */
+	long tick_ns;			/* Time the race engine last woke horses and sessions */
+	sched_stats sched[ROLE_COUNT];	/* Scheduling latency of every thread role (ROLE_*) */
+};
+
+typedef struct {
+	cpu_set_t cpus;			/* CPUs threads of the role are pinned to */
+	short pinned;			/* Tells whether cpus were configured (==1 if so) */
+	int priority;			/* SCHED_FIFO priority, 0 keeps the default policy */
+} thread_role;
+
+typedef struct {
+	char path[HANDOFF_PATH_LEN];	/* Path of the socket, "@name" for the abstract namespace (empty disables the listener) */
+	uid_t uids[LOCAL_MAX_UIDS];	/* Users allowed to connect */
+	int uid_count;			/* Number of allowed users, 0 admits only the user running the server */
+} local_listener;
+
+typedef struct {
+	int io_backend;			/* Requested session I/O backend (IO_BACKEND_THREADS or IO_BACKEND_URING) */
+	thread_role roles[ROLE_COUNT];	/* Placement of every thread role (ROLE_*) */
+	unsigned long trace_events;	/* Trace events kept per thread, 0 disables tracing */
+	char upgrade_path[HANDOFF_PATH_LEN];	/* Unix socket used to hand the server over to a new build (empty disables upgrades) */
+	char export_name[NAME_MAX + 1];	/* Shared-memory segment live race state is exported to (empty disables export) */
+	local_listener local;		/* Unix socket serving co-located clients */
+	char replica_path[HANDOFF_PATH_LEN];	/* Unix socket the hot standby follows the leader on (empty disables replication) */
+	int replica_ack_ms;		/* Longest wait of a bet for the standby, 0 does not wait */
+	char journal_path[PATH_MAX];	/* File settled races are appended to (empty disables the journal) */
+	rate_limit cmd;			/* Commands per session */
+	rate_limit bet;			/* Bets per session */
+	rate_limit ip_cmd;		/* Commands per client address */
+	rate_limit ip_bet;		/* Bets per client address */
+} server_conf;
+
+typedef struct {
+	int refs;			/* Number of queued sends still referencing the message */
+	size_t len;			/* Message length */
+	char data[];			/* Message contents */
+} uring_msg;
+
+typedef struct uring_send {
+	uring_msg* msg;			/* Message being sent */
+	struct uring_send* next;	/* Next send queued on the same session */
+	struct player_th_data* session;	/* Session the send belongs to */
+} uring_send;
+
+typedef struct handoff_state handoff_state;
+typedef struct track_export track_export;
+typedef struct replica_state replica_state;
+
+typedef struct player_th_data {
 	player** players;		/* Array of all players */
 	int socket;			/* Socket of player's connection */
+	int index;			/* Index of the logged in player (-1 before login) */
+	struct uring_loop* loop;	/* io_uring loop serving the session (NULL for thread-per-connection backend) */
+	struct player_th_data* prev;	/* Previous session served by the io_uring loop */
+	struct player_th_data* next;	/* Next session served by the io_uring loop */
+	struct player_th_data* next_flush;	/* Next session waiting for its sends to be submitted */
+	uring_send* out_head;		/* First send queued but not yet submitted */
+	uring_send* out_tail;		/* Last send queued but not yet submitted */
+	int sends_in_flight;		/* Number of submitted sends not completed yet */
+	short flush_pending;		/* Session is on the loop's flush list */
+	short recv_armed;		/* Multishot recv is armed on the socket */
+	short closing;			/* Session is being torn down */
+	short throttled;		/* Last command was dropped by rate limits */
+	short adopted;			/* Session was taken over from the previous process */
+	short local;			/* Session of a co-located client admitted by credentials, exempt from rate limits */
+	short parked;			/* Replies wait for the standby to acknowledge the last bet (io_uring backend) */
+	uint64_t ack_seq;		/* Replica record of the last bet of the session (0 if none) */
+	long ack_deadline;		/* Time parked replies are sent without the acknowledgement */
+	struct player_th_data* next_parked;	/* Next session parked on the io_uring loop */
+	short holding;			/* Replies are held back until the ledger lock is released (threads backend) */
+	char* held;			/* Replies held back */
+	size_t held_len;		/* Length of held replies */
+	size_t held_capacity;		/* Size of the held buffer */
+	struct player_th_data* all_prev;	/* Previous session of the process */
+	struct player_th_data* all_next;	/* Next session of the process */
+	in_addr_t peer;			/* Client address (0 if not an inet socket) */
+	token_bucket cmd_bucket;	/* Commands sent on the session */
+	token_bucket bet_bucket;	/* Bets sent on the session */
 	int* state;			/* Indicates state of the server (either accepting bets or handling the race */
 	int* bank;			/* Pointer to bank */
 	int horse_count;		/* Number of all horses */
@@ -82,10 +443,22 @@ typedef struct {
 	pthread_cond_t* cond;		/* Conditional variable used to signal race turns */
 	horse*** curr_running_horses;	/* Pointer to array of horses running in current/upcoming race */
 	horse** winner;			/* Pointer to winner of the race */
+	bet_book* book;			/* Tickets of the upcoming race */
+	race_template* tmpl;		/* Static parts of replies about the upcoming/current race */
+	race_snapshots* snapshots;	/* Published answers to next and last race commands */
+	rate_limiter* limiter;		/* Command and bet rate limits */
+	server_metrics* metrics;	/* Server counters */
+	handoff_state* handoff;		/* Sessions list and ledger lock used by upgrades */
+	track_export* export;		/* Shared-memory export of race state */
+	replica_state* replica;		/* Replication of ledger changes to the standby */
+	tick_ring* ticks;		/* Recent race turns replayed to resumed sessions */
+	thread_role* io_role;		/* Placement of connection threads */
 } player_th_data;
 
 typedef struct {
 	int socket;			/* Socket used to accept new connections */
+	int local_socket;		/* Unix socket used to accept co-located clients (-1 if none) */
+	local_listener* local;		/* Users allowed on the unix socket */
 	horse* horses;			/* Array of all horses */
 	int horse_count;		/* Number of horses */
 	int* state;			/* Indicates state of the server (either accepting bets or handling the race */
@@ -100,6 +473,16 @@ typedef struct {
 	pthread_mutex_t* mutex;		/* Pointer to mutex used to simulate race turns */
 	pthread_mutex_t* bank_mutex;	/* Mutex for bank access */
 	horse*** curr_running_horses;	/* Pointer to array of horses running in current/upcoming race */
+	bet_book* book;			/* Tickets of the upcoming race */
+	race_template* tmpl;		/* Static parts of replies about the upcoming/current race */
+	race_snapshots* snapshots;	/* Published answers to next and last race commands */
+	rate_limiter* limiter;		/* Command and bet rate limits */
+	server_metrics* metrics;	/* Server counters */
+	thread_role* io_role;		/* Placement of connection threads */
+	handoff_state* handoff;		/* Sessions list and ledger lock used by upgrades */
+	track_export* export;		/* Shared-memory export of race state */
+	replica_state* replica;		/* Replication of ledger and race state to the standby */
+	tick_ring* ticks;		/* Recent race turns replayed to resumed sessions */
 } acc_clients_args;
 
 typedef struct {
@@ -116,10 +499,149 @@ typedef struct {
 	pthread_cond_t* cond;		/* Conditional variable used to signal race turns */
 	pthread_barrier_t* barrier;	/* Barrier used to ensure that every horse ends his turn before next */
 	horse*** curr_running_horses;	/* Pointer to array of horses running in current/upcoming race */
+	int tick_fd;			/* Eventfd signaled on every race turn (-1 when unused) */
+	bet_book* book;			/* Tickets of the upcoming race */
+	race_template* tmpl;		/* Static parts of replies about the upcoming/current race */
+	race_snapshots* snapshots;	/* Published answers to next and last race commands */
+	server_metrics* metrics;	/* Server counters */
+	track_export* export;		/* Shared-memory export of race state */
+	replica_state* replica;		/* Replication of race state to the standby */
+	bet_journal* journal;		/* Journal of settled races */
+	tick_ring* ticks;		/* Recent race turns replayed to resumed sessions */
+	time_t* time;			/* Time of interval between races start */
+	handoff_state* handoff;		/* Upgrade state, the next race is not set up while a handoff is pending */
 } race_args;
 
+struct track_export {
+	track_shm* shm;			/* Mapped segment (NULL when export is disabled) */
+	char name[NAME_MAX + 1];	/* Name of the segment */
+	race_args* race;		/* Race state being exported */
+	horse* slots[MAX_HORSES_PER_RACE];	/* Horses of the exported field by slot */
+};
+
+typedef struct uring_loop {
+	int fd;				/* io_uring instance */
+	void* ring;			/* Mapped submission and completion rings */
+	size_t ring_size;		/* Size of the mapped rings */
+	struct io_uring_sqe* sqes;	/* Submission queue entries */
+	unsigned* sq_head;		/* Submission queue head (kernel owned) */
+	unsigned* sq_tail;		/* Submission queue tail */
+	unsigned* sq_array;		/* Submission queue index array */
+	unsigned sq_mask;		/* Submission queue ring mask */
+	unsigned sq_entries;		/* Submission queue size */
+	unsigned* cq_head;		/* Completion queue head */
+	unsigned* cq_tail;		/* Completion queue tail (kernel owned) */
+	unsigned cq_mask;		/* Completion queue ring mask */
+	struct io_uring_cqe* cqes;	/* Completion queue entries */
+	unsigned to_submit;		/* Entries prepared since last io_uring_enter */
+	struct io_uring_buf_ring* buf_ring;	/* Ring of buffers provided for multishot recv */
+	char* bufs;			/* Memory backing the provided buffers */
+	unsigned short buf_tail;	/* Local tail of the provided buffer ring */
+	int tick_fd;			/* Eventfd signaled on every race turn */
+	uint64_t tick_val;		/* Destination of eventfd reads */
+	acc_clients_args* args;		/* Shared server state */
+	player_th_data* sessions;	/* All sessions served by the loop */
+	player_th_data* flush;		/* Sessions waiting for their sends to be submitted */
+	int ack_fd;			/* Eventfd signaled when the standby acknowledges records */
+	uint64_t ack_val;		/* Destination of ack eventfd reads */
+	player_th_data* parked;		/* Sessions whose replies wait for the standby, oldest first */
+	struct __kernel_timespec park_ts;	/* Deadline of the oldest parked session */
+	short park_armed;		/* Timeout of the oldest parked session is armed (==1 if so) */
+} uring_loop;
+
+typedef struct {
+	uint32_t magic;			/* HANDOFF_MAGIC */
+	int32_t bank;			/* Money in the bank */
+	int32_t horse_count;		/* Number of horses, both builds must read the same configuration */
+	int32_t winner;			/* Index of the last race winner (-1 if none) */
+	int32_t field[MAX_HORSES_PER_RACE];	/* Indexes of horses in the upcoming race (-1 for empty places) */
+	int64_t next_start;		/* Time the upcoming race starts */
+	int32_t player_count;		/* Number of handoff_player records following */
+	int32_t session_count;		/* Number of client sockets following the listening sockets */
+	int32_t local_listener;		/* Tells whether unix listening socket follows the inet one (==1 if so) */
+	int32_t replica_listener;	/* Tells whether replica listening socket follows the unix one (==1 if so) */
+	int32_t ticket_count;		/* Number of tickets in the bet book columns following the rest factors */
+	int64_t pools[BET_TYPES];	/* Pools of the bet book by bet type */
+} handoff_header;
+
+typedef struct {
+	int32_t index;			/* Slot of the player */
+	int32_t money;			/* Player's money */
+	int32_t horse_bet;		/* Index of the horse bet on (-1 if none) */
+	int32_t money_bet;		/* Stake of the bet */
+	char name[MAX_NAME_LEN];	/* Name of the player */
+	uint64_t token;			/* Resume token of the player */
+} handoff_player;
+
+typedef struct {
+	int socket;			/* Client socket received from the previous process */
+	int index;			/* Player logged in on the socket (-1 before login) */
+} handoff_session;
+
+struct handoff_state {
+	char path[HANDOFF_PATH_LEN];	/* Unix socket the next build connects to (empty disables upgrades) */
+	int listen_fd;			/* Socket accepting the next build (-1 if none) */
+	pthread_rwlock_t ledger_lock;	/* Held shared while commands run, exclusively while state is handed over */
+	pthread_mutex_t mutex;		/* Mutex guarding list of sessions */
+	player_th_data* sessions;	/* All sessions of the process */
+	short pending;			/* Next race waits for the handoff in progress (==1 if so) */
+	short accept_paused;		/* Client sockets are being passed to the next build, the acceptor leaves them queued (==1 if so) */
+	int wake_fd;			/* Eventfd waking the threads backend acceptor when accept_paused changes */
+	short resumed;			/* Betting window was taken over from the previous process (==1 if so) */
+	acc_clients_args* args;		/* Shared server state */
+	uring_loop* loop;		/* io_uring loop serving sessions (NULL with threads backend) */
+	handoff_session* adopted;	/* Sessions received from the previous process */
+	int adopted_count;		/* Number of adopted sessions */
+};
+
+typedef struct {
+	int32_t type;			/* REPLICA_* */
+	int32_t index;			/* Slot of the player, or horse of REPLICA_HORSE */
+	int32_t arg;			/* Bet type of REPLICA_BET, turn of REPLICA_TICK, last winner of REPLICA_SYNC (-1 if none) */
+	int32_t money;			/* Player's money after the change */
+	int32_t stake;			/* Stake of REPLICA_BET */
+	int32_t bank;			/* Money in the bank after the change */
+	int64_t pools[BET_TYPES];	/* Pools of the bet book (REPLICA_SYNC) */
+	int64_t next_start;		/* Time the upcoming race starts (REPLICA_COUNTDOWN, REPLICA_SYNC) */
+	uint64_t token;			/* Resume token of the player (REPLICA_PLAYER) */
+	char name[MAX_NAME_LEN];	/* Name of the player (REPLICA_PLAYER) */
+	int16_t horses[MAX_HORSES_PER_RACE];	/* Picks of a bet, the field or the finish order (-1 for empty places) */
+	int32_t distance[MAX_HORSES_PER_RACE];	/* Distances run by the field */
+	float rest[MAX_HORSES_PER_RACE];	/* Rest factors of the field, of the horse for REPLICA_HORSE */
+} replica_record;
+
+struct replica_state {
+	char path[HANDOFF_PATH_LEN];	/* Unix socket of the leader, "@name" for the abstract namespace (empty disables replication) */
+	int listen_fd;			/* Socket accepting the standby (-1 unless leading) */
+	int fd;				/* Connected standby (-1 if none) */
+	int wake_fd;			/* Eventfd waking the sender when records are queued */
+	int notify_fd;			/* Eventfd waking the io_uring loop on acknowledgements (-1 if none) */
+	int ack_ms;			/* Longest wait of a bet for the standby, 0 does not wait */
+	short stopping;			/* Sender is asked to exit (==1 if so) */
+	short handed_over;		/* Listening socket was passed to the next build, the sender stops accepting (==1 if so) */
+	pthread_t tid;			/* Sender thread */
+	pthread_mutex_t mutex;		/* Mutex guarding the queue, the standby socket and acknowledgements */
+	pthread_cond_t acked_cond;	/* Signaled on acknowledgements and when the standby goes away */
+	char* queue;			/* Records waiting to be sent */
+	size_t queued;			/* Bytes waiting in queue */
+	size_t capacity;		/* Size of queue */
+	char* spare;			/* Buffer swapped with queue while records are sent */
+	size_t spare_capacity;		/* Size of spare */
+	size_t spare_len;		/* Bytes of records in spare */
+	size_t spare_sent;		/* Bytes of spare the standby socket took so far */
+	uint64_t seq;			/* Records queued for the connected standby */
+	uint64_t acked;			/* Records the standby applied */
+	acc_clients_args* args;		/* Shared server state */
+};
+
+pool pools[POOL_COUNT];			/* Allocators of fixed-size objects (POOL_*) */
+__thread pool_cache pool_caches[POOL_COUNT];	/* Per-thread caches of the pools */
+const char* role_names[ROLE_COUNT] = {"race", "io", "accept", "state"};	/* Names of thread roles in reports */
+tracer trace;					/* Timeline of race and session events */
+__thread trace_ring* trace_local;		/* Ring of the calling thread (NULL when not traced) */
+
 void usage(void) {
-	fprintf(stderr, "USAGE: server port\n");
+	fprintf(stderr, "USAGE: server port [--standby]\n");
 }
 
 ssize_t bulk_read(int fd, char* buf, size_t count) {
@@ -149,6 +671,26 @@ ssize_t bulk_write(int fd, char* buf, size_t count) {
 	return len;
 }
 
+ssize_t bulk_writev(int fd, struct iovec* iov, int iovcnt) {
+	ssize_t c;
+	size_t len = 0;
+	while(iovcnt > 0) {
+		c = TEMP_FAILURE_RETRY(writev(fd, iov, iovcnt));
+		if(c < 0) return c;
+		len += c;
+		while(iovcnt > 0 && (size_t) c >= iov->iov_len) {
+			c -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + c;
+			iov->iov_len -= c;
+		}
+	}
+	return len;
+}
+
 /*
 * Sets action for signal inside the thread.
 *
@@ -176,629 +718,4995 @@ void sigint_handler(int sigNo) {
 }
 
 /*
-* Registers player in the system.
-* LF and CR characters are chopped from name.
-*
-* @players: array of all players
-* @pl_len:  players' array length
-* @name:    name of player being registered
-* @len:	    name length
+* Initializes pool of fixed-size objects.
 *
-* Returns registered player's index.
+* @p:        pool to be initialized
+* @obj_size: size of one object
 */
-int register_player(player** players, int pl_len, char* name, int len) {
-	int i, empty_slot;
-	char buf[MAX_NAME_LEN];
-
-	for(i = 0; i < pl_len; ++i) {
-		if(players[i] == NULL) {
-			empty_slot = i;
-			break;
-		}
+void pool_init(pool* p, size_t obj_size) {
+	p->obj_size = (obj_size < sizeof(pool_obj)) ? sizeof(pool_obj) : (obj_size + 15) & ~(size_t) 15;
+	p->slab_objs = (POOL_SLAB_SIZE - 16) / p->obj_size;
+	p->free = NULL;
+	p->slabs = NULL;
+	if(pthread_mutex_init(&p->mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
 	}
+}
 
-	if(i == pl_len) {
-		fprintf(stderr, "Cannot register more players.\n");
-		return -1;
-	}
+/*
+* Frees all slabs of the pool. Objects still in use become invalid.
+*/
+void pool_destroy(pool* p) {
+	void* slab;
 
-	if( (players[i] = (player*) malloc(sizeof(player))) == NULL) {
-		ERR("malloc");
+	while( (slab = p->slabs) ) {
+		p->slabs = *(void**) slab;
+		free(slab);
+	}
+	p->free = NULL;
+	if(pthread_mutex_destroy(&p->mutex) != 0) {
+		ERR("pthread_mutex_destroy");
 	}
-
-	/* Copy name without CR and LF characters*/
-	memcpy(buf, name, (len - 2 < MAX_NAME_LEN) ? len - 2 : MAX_NAME_LEN);
-
-	players[empty_slot]->money = 0;
-	strcpy(players[empty_slot]->name, buf);
-
-	fprintf(stderr, "Player %s registered.\n", buf);
-	
-	return empty_slot;
 }
 
-void deposit(int socket, player* pl, int deposit) {
-	if(deposit < 0) {
-		if(bulk_write(socket, CANT_DEP_NEGATIVE_MSG, strlen(CANT_DEP_NEGATIVE_MSG)) < 0 && errno != EPIPE) {
-			ERR("write");
+/*
+* Moves a batch of objects from the pool to the calling thread's cache,
+* carving a new slab when the pool runs dry.
+*/
+void pool_refill(pool* p, pool_cache* cache) {
+	char* slab;
+	pool_obj* obj;
+	size_t i;
+
+	if(pthread_mutex_lock(&p->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(p->free == NULL) {
+		if( (slab = (char*) malloc(POOL_SLAB_SIZE)) == NULL) {
+			ERR("malloc");
+		}
+		*(void**) slab = p->slabs;
+		p->slabs = slab;
+		for(i = 0; i < p->slab_objs; ++i) {
+			obj = (pool_obj*) (slab + 16 + i * p->obj_size);
+			obj->next = p->free;
+			p->free = obj;
 		}
 	}
-	pl->money += deposit;
+	while(p->free && cache->count < POOL_CACHE_BATCH) {
+		obj = p->free;
+		p->free = obj->next;
+		obj->next = cache->free;
+		cache->free = obj;
+		++cache->count;
+	}
+	if(pthread_mutex_unlock(&p->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
 }
 
-void withdraw(int socket, player* pl, int amount) {
-	if(pl->money - amount < 0) {
-		if(bulk_write(socket, CANT_WITHDRAW_MSG, strlen(CANT_WITHDRAW_MSG)) < 0 && errno != EPIPE) {
-			ERR("write");
-		}
-		return;
-	}
+/*
+* Returns up to @count objects from the calling thread's cache to the pool.
+*/
+void pool_drain(pool* p, pool_cache* cache, int count) {
+	pool_obj* obj;
 
-	pl->money -= amount;
+	if(pthread_mutex_lock(&p->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	while(cache->free && count-- > 0) {
+		obj = cache->free;
+		cache->free = obj->next;
+		obj->next = p->free;
+		p->free = obj;
+		--cache->count;
+	}
+	if(pthread_mutex_unlock(&p->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
 }
 
-void bet(int socket, player* pl, char* cmd, horse* horses, int horse_count, int* bank, pthread_mutex_t* bank_mutex) {
-	int i, money_bet;
-	char* second, *third, *save_ptr;
-	printf("cmd: %s\n", cmd);
-	second = strtok_r(cmd, " ", &save_ptr);
-	second = strtok_r(NULL, " ", &save_ptr);
-
-	printf("second: %s\n", second);
-
-	if(second) {
-		third = strtok_r(NULL, " ", &save_ptr);
-		if( third ) {	
-			printf("third: %s\n", third);
-			money_bet = atoi(third);
-			if(money_bet <= 0) {
-				if(bulk_write(socket, CANT_BET_NEGATIVE_MSG, strlen(CANT_BET_NEGATIVE_MSG)) < 0 && errno != EPIPE) {
-					ERR("write");
-				}
-			}
-			if(money_bet > pl->money) {
-				if(bulk_write(socket, CANT_BET_MSG, strlen(CANT_BET_MSG)) < 0 && errno != EPIPE) {
-					ERR("write");
-				}
-				return;
-			}
-			for(i = 0; i < horse_count; ++i) {
-				if( !strcmp(second, horses[i].name) ) {
-					pl->horse_bet = &horses[i];
-					pl->money_bet = money_bet;
-					pl->money -= money_bet;
-					pthread_mutex_lock(bank_mutex);
-					*bank += money_bet;
-					pthread_mutex_unlock(bank_mutex);
-					return;
-				}
-			}
-		}
-	}
+/*
+* Allocates zeroed object from the pool, going through the calling thread's cache.
+*
+* @id: index of the pool (POOL_*)
+*/
+void* pool_alloc(int id) {
+	pool_cache* cache = &pool_caches[id];
+	pool_obj* obj;
 
-	if(bulk_write(socket, NO_SUCH_HORSE_MSG, strlen(NO_SUCH_HORSE_MSG)) < 0 && errno != EPIPE) {
-		ERR("write");
+	if(cache->free == NULL) {
+		pool_refill(&pools[id], cache);
 	}
+	obj = cache->free;
+	cache->free = obj->next;
+	--cache->count;
+	memset(obj, 0, pools[id].obj_size);
+	return obj;
 }
 
 /*
-* Sends player info to the client.
+* Returns object to the calling thread's cache. Objects may be freed by any thread.
 *
-* @socket: socket for the client's connection
-* @pl:     pointer to the player
+* @id:  index of the pool (POOL_*)
+* @ptr: object to be freed (may be NULL)
 */
-void print_info(int socket, player* pl) {
-	char send_info[LINE_BUF];
-	snprintf(send_info, LINE_BUF, "Player: %s, money: %d, Bet on horse: %s with %d money\n", pl->name, pl->money, (pl->horse_bet) ? pl->horse_bet->name : "none", pl->money_bet);
-	if(bulk_write(socket, send_info, strlen(send_info)) < 0 && errno != EPIPE) {
-		ERR("write");
+void pool_free(int id, void* ptr) {
+	pool_cache* cache = &pool_caches[id];
+	pool_obj* obj = (pool_obj*) ptr;
+
+	if(obj == NULL) {
+		return;
+	}
+	obj->next = cache->free;
+	cache->free = obj;
+	if(++cache->count > POOL_CACHE_MAX) {
+		pool_drain(&pools[id], cache, POOL_CACHE_BATCH);
 	}
 }
 
-void next_race_time(int socket, player* pl, time_t* start_time, int* interval, horse*** curr_running_horses) {
-	char send_info[LINE_BUF];
-	char next_race_info[LINE_BUF * (MAX_HORSES_PER_RACE + 1)];
+/*
+* Returns all objects cached by the calling thread. Must be called before the thread exits.
+*/
+void pool_thread_flush(void) {
 	int i;
 
-	memset(send_info, 0, LINE_BUF);
-	memset(next_race_info, 0, LINE_BUF * (MAX_HORSES_PER_RACE + 1));
-	snprintf(send_info, LINE_BUF, "Next race in %d seconds...\nHorses running in the next race:\n", *interval - (int) (time(NULL) - (*start_time)));
-	strcat(next_race_info, send_info);
-	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
-		if((*curr_running_horses)[i]) {
-			snprintf(send_info, LINE_BUF, "\t%s\n", (*curr_running_horses)[i]->name);
-			strcat(next_race_info, send_info);
+	for(i = 0; i < POOL_COUNT; ++i) {
+		if(pool_caches[i].count > 0) {
+			pool_drain(&pools[i], &pool_caches[i], pool_caches[i].count);
 		}
 	}
-	strcat(next_race_info, "\n");
-	if(bulk_write(socket, next_race_info, LINE_BUF * (MAX_HORSES_PER_RACE + 1)) < 0 && errno != EPIPE) {
-		ERR("write");
-	}
 }
 
-void last_race_info(int socket, player* pl, horse* winner) {
-	char send_info[LINE_BUF];
-	if(winner == NULL) {
+/*
+* Grows columns of the bet book to hold at least the given number of tickets.
+* Columns are kept between races, settled books are only emptied.
+*/
+void book_reserve(bet_book* book, int capacity) {
+	int i;
+
+	if(capacity <= book->capacity) {
 		return;
 	}
-
-	snprintf(send_info, LINE_BUF, "Last race winner: %s\n", winner->name);
-	if(bulk_write(socket, send_info, strlen(send_info)) < 0 && errno != EPIPE) {
-		ERR("write");
+	if(capacity < BOOK_MIN_CAPACITY) {
+		capacity = BOOK_MIN_CAPACITY;
+	}
+	if(capacity < 2 * book->capacity) {
+		capacity = 2 * book->capacity;
+	}
+	if( (book->player = (int32_t*) realloc(book->player, capacity * sizeof(int32_t))) == NULL ||
+		(book->type = (uint8_t*) realloc(book->type, capacity * sizeof(uint8_t))) == NULL ||
+		(book->stake = (int32_t*) realloc(book->stake, capacity * sizeof(int32_t))) == NULL ||
+		(book->hit = (uint8_t*) realloc(book->hit, capacity * sizeof(uint8_t))) == NULL ||
+		(book->payout = (int32_t*) realloc(book->payout, capacity * sizeof(int32_t))) == NULL) {
+		ERR("realloc");
 	}
+	for(i = 0; i < BET_PLACES; ++i) {
+		if( (book->sel[i] = (int16_t*) realloc(book->sel[i], capacity * sizeof(int16_t))) == NULL) {
+			ERR("realloc");
+		}
+	}
+	book->capacity = capacity;
 }
 
-int get_value(char* buf) {
-	char* second;
-	
-	second = strchr(buf, ' ');
+/*
+* Records a ticket, bank_mutex must be held.
+*
+* @book:   bet book of the upcoming race
+* @player: index of the betting player
+* @type:   bet type, picks sel[0] to sel[type]
+* @sel:    indexes of picked horses
+* @stake:  money bet
+*/
+void book_add(bet_book* book, int player, int type, int16_t* sel, int stake) {
+	int i, n = book->count;
 
-	if(second && *(second + 1)) {
-		printf("%s\n", second + 1);
-		return atoi(second+1);
+	book_reserve(book, n + 1);
+	book->player[n] = player;
+	book->type[n] = type;
+	for(i = 0; i < BET_PLACES; ++i) {
+		book->sel[i][n] = (i <= type) ? sel[i] : -1;
 	}
-	return 0;
+	book->stake[n] = stake;
+	book->pool[type] += stake;
+	book->count = n + 1;
 }
 
-void notify_race_info(player_th_data* data, int socket) {
+void book_destroy(bet_book* book) {
 	int i;
-	char race_status[LINE_BUF * MAX_HORSES_PER_RACE];
-	char one_line_status[LINE_BUF];
-	memset(race_status, 0, LINE_BUF * MAX_HORSES_PER_RACE);
-	memset(one_line_status, 0, LINE_BUF);
-	while(*data->state != STATE_NOT_RACING && !exit_flag) {
-		pthread_mutex_lock(data->mutex);
-		if(pthread_cond_wait(data->cond, data->mutex) != 0) {
-			ERR("pthread_mutex_unlock");
-		}
-		if(pthread_mutex_unlock(data->mutex) != 0) {
-			ERR("pthread_mutex_unlock");
-		}
-		for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
-			if(!(*data->winner) && (*data->curr_running_horses)[i]) {
-				snprintf(one_line_status, LINE_BUF, "%s dinstance: %d\n", (*data->curr_running_horses)[i]->name, (*data->curr_running_horses)[i]->distance_run);
-				strcat(race_status, one_line_status);
-			}
-		}
-		strcat(race_status, "\n");
-		if(bulk_write(socket, race_status, LINE_BUF * MAX_HORSES_PER_RACE) < 0 && errno != EPIPE) {
-			ERR("write");
-		}
-		race_status[0]='\0';
+
+	free(book->player);
+	free(book->type);
+	free(book->stake);
+	free(book->hit);
+	free(book->payout);
+	for(i = 0; i < BET_PLACES; ++i) {
+		free(book->sel[i]);
 	}
+	memset(book, 0, sizeof(bet_book));
 }
 
-void route_cmd(int socket, int index, player_th_data* data, player** players) {
-	int count;
-	char buf[BUF_SIZE];
+long monotonic_ns(void) {
+	struct timespec ts;
 
-	count = read(socket, buf, BUF_SIZE);
-		
-	if(count < 0) {
-		ERR("read");
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		ERR("clock_gettime");
 	}
-
-	switch(buf[0]) {
-		case 'd':
-			/* deposit */
-			deposit(socket, players[index], get_value(buf));
-			break;
-		case 'w':
-			/* withdraw */
-			withdraw(socket, players[index], get_value(buf));
-			break;
-		case 'i':
-			/* info */
-			print_info(socket, players[index]);
-			break;
-		case 'n':
-			/* next */
-			next_race_time(socket, players[index], data->time, data->interval, data->curr_running_horses);
-			break;
-		case 'l':
-			/* last */
-			last_race_info(socket, players[index], *data->winner);
-			break;
-		case 'b':
-			/* bet */
-			bet(socket, players[index], buf, data->horses, data->horse_count, data->bank, data->bank_mutex);
-			break;
-		default:
-			if(bulk_write(socket, UNWN_CMD_MSG, strlen(UNWN_CMD_MSG)) < 0 && errno != EPIPE) {
-				ERR("write");
-			}
-			break;
-	}		
-	memset(buf, 0, BUF_SIZE);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 }
 
-/**
-* Handles one connection (always runs on separate thread)
-* @th_data: thread argument, see: @player_th_data structure.
-*/
-void* handle_connection(void* th_data) {
-	player_th_data* data = (player_th_data*) th_data;
-	int socket = data->socket, count, index, result;
-	char buf[BUF_SIZE];
-	player** players = data->players;
-	fd_set read_set;
-	struct timeval tv, ttv = {0, 500000};
-
-	memset(buf, 0, BUF_SIZE);
-
-	if(bulk_write(socket, ENTER_LOGIN_MSG, strlen(ENTER_LOGIN_MSG)) < 0 && errno != EPIPE) {
-		ERR("write");
+void trace_init(unsigned long events) {
+	memset(&trace, 0, sizeof(tracer));
+	if(pthread_mutex_init(&trace.mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
+	}
+	if(events == 0) {
+		return;
 	}
+	for(trace.size = 1; trace.size < events; trace.size <<= 1);
+	trace.enabled = 1;
+}
 
-	if( (count = read(socket, buf, BUF_SIZE)) < 0) {
-		ERR("read");
+void trace_destroy(void) {
+	trace_ring* ring;
+
+	while( (ring = trace.rings) != NULL) {
+		trace.rings = ring->next;
+		free(ring->events);
+		free(ring);
 	}
-	
-	if(count == 0) {
-		fprintf(stderr, "Connection closed.\n");
-		pthread_exit(NULL);
+	if(pthread_mutex_destroy(&trace.mutex) != 0) {
+		ERR("pthread_mutex_destroy");
 	}
+}
 
-	index = register_player(players, MAX_PLAYERS,  buf, strlen(buf));
-	
-	notify_race_info(data, socket);
+/*
+* Gives the calling thread a ring for its events.
+* Rings of finished threads are kept for dumps until a new thread takes them over.
+*
+* @name: thread name shown in the trace
+*/
+void trace_thread(const char* name) {
+	trace_ring* ring;
+	int i;
+
+	if(!trace.enabled || trace_local) {
+		return;
+	}
+	if(pthread_mutex_lock(&trace.mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	for(ring = trace.rings; ring && ring->alive; ring = ring->next);
+	if(!ring) {
+		if( (ring = (trace_ring*) calloc(1, sizeof(trace_ring))) == NULL ||
+			(ring->events = (trace_event*) calloc(trace.size, sizeof(trace_event))) == NULL) {
+			ERR("calloc");
+		}
+		ring->next = trace.rings;
+		trace.rings = ring;
+	}
+	ring->id = ++trace.ring_count;
+	ring->alive = 1;
+	ring->head = 0;
+	snprintf(ring->name, TRACE_NAME_LEN, "%s", name);
+	for(i = 0; ring->name[i]; ++i) {
+		if(ring->name[i] == '"' || ring->name[i] == '\\') {
+			ring->name[i] = '_';
+		}
+	}
+	if(pthread_mutex_unlock(&trace.mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	trace_local = ring;
+}
+
+void trace_thread_exit(void) {
+	if(!trace_local) {
+		return;
+	}
+	if(pthread_mutex_lock(&trace.mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	trace_local->alive = 0;
+	if(pthread_mutex_unlock(&trace.mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	trace_local = NULL;
+}
+
+/*
+* Opens a scoped trace event.
+*
+* Returns start of the event, 0 when tracing is disabled.
+*/
+long trace_begin(void) {
+	return trace.enabled ? monotonic_ns() : 0;
+}
+
+/*
+* Closes a scoped trace event and stores it in the ring of the calling thread.
+*
+* @name:  name of the event (string literal)
+* @begin: value returned by trace_begin
+*/
+void trace_end(const char* name, long begin) {
+	trace_ring* ring = trace_local;
+	trace_event* ev;
+
+	if(begin == 0 || ring == NULL) {
+		return;
+	}
+	ev = &ring->events[ring->head & (trace.size - 1)];
+	ev->name = name;
+	ev->begin = begin;
+	ev->end = monotonic_ns();
+	ev->race = __atomic_load_n(&trace.race, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Draws a resume token for the player slot. The slot is kept in the top byte so a token finds its
+* player without a lookup, the rest is random and never 0.
+*/
+uint64_t new_token(int slot) {
+	uint64_t secret;
+
+	if(getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+		ERR("getrandom");
+	}
+	return ((uint64_t) slot << TOKEN_SLOT_SHIFT) | (secret & (((uint64_t) 1 << TOKEN_SLOT_SHIFT) - 1)) | 1;
+}
+
+/*
+* Registers player in the system.
+* LF and CR characters are chopped from name.
+*
+* @players: array of all players
+* @pl_len:  players' array length
+* @name:    name of player being registered
+* @len:	    name length
+*
+* Returns registered player's index.
+*/
+int register_player(player** players, int pl_len, char* name, int len) {
+	int i, empty_slot;
+	char buf[MAX_NAME_LEN];
+
+	for(i = 0; i < pl_len; ++i) {
+		if(players[i] == NULL) {
+			empty_slot = i;
+			break;
+		}
+	}
+
+	if(i == pl_len) {
+		fprintf(stderr, "Cannot register more players.\n");
+		return -1;
+	}
+
+	players[i] = (player*) pool_alloc(POOL_PLAYERS);
+
+	/* Copy name without CR and LF characters*/
+	len = (len - 2 < MAX_NAME_LEN - 1) ? len - 2 : MAX_NAME_LEN - 1;
+	memcpy(buf, name, (len > 0) ? len : 0);
+	buf[(len > 0) ? len : 0] = '\0';
+
+	players[empty_slot]->money = 0;
+	players[empty_slot]->token = new_token(empty_slot);
+	strcpy(players[empty_slot]->name, buf);
+
+	fprintf(stderr, "Player %s registered.\n", buf);
+	
+	return empty_slot;
+}
+
+/*
+* Shared hold on players and bank taken around commands, a handoff to the next build takes it exclusively.
+*/
+void ledger_lock(handoff_state* h) {
+	if(pthread_rwlock_rdlock(&h->ledger_lock) != 0) {
+		ERR("pthread_rwlock_rdlock");
+	}
+}
+
+void ledger_unlock(handoff_state* h) {
+	if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+		ERR("pthread_rwlock_unlock");
+	}
+}
+
+void handoff_add_session(handoff_state* h, player_th_data* session) {
+	if(pthread_mutex_lock(&h->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	session->all_prev = NULL;
+	session->all_next = h->sessions;
+	if(h->sessions) {
+		h->sessions->all_prev = session;
+	}
+	h->sessions = session;
+	if(pthread_mutex_unlock(&h->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+void handoff_remove_session(handoff_state* h, player_th_data* session) {
+	if(pthread_mutex_lock(&h->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(session->all_prev) {
+		session->all_prev->all_next = session->all_next;
+	} else {
+		h->sessions = session->all_next;
+	}
+	if(session->all_next) {
+		session->all_next->all_prev = session->all_prev;
+	}
+	if(pthread_mutex_unlock(&h->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+void uring_queue_msg(player_th_data* session, uring_msg* msg);
+
+/*
+* Appends a reply to the ones held back while the session holds the ledger lock.
+*/
+void session_append_held(player_th_data* data, char* buf, size_t count) {
+	if(data->held_len + count > data->held_capacity) {
+		data->held_capacity = (data->held_len + count) * 2;
+		if( (data->held = (char*) realloc(data->held, data->held_capacity)) == NULL) {
+			ERR("realloc");
+		}
+	}
+	memcpy(data->held + data->held_len, buf, count);
+	data->held_len += count;
+}
+
+/*
+* Sends message to the session's client.
+* With io_uring backend the message is copied and queued, otherwise it is written synchronously.
+*
+* @data:  session of the client
+* @buf:   message
+* @count: message length
+*/
+void session_write(player_th_data* data, char* buf, size_t count) {
+	uring_msg* msg;
+	long begin;
+
+	if(data->holding) {
+		session_append_held(data, buf, count);
+		return;
+	}
+	if(data->loop) {
+		if( (msg = (uring_msg*) malloc(sizeof(uring_msg) + count)) == NULL) {
+			ERR("malloc");
+		}
+		msg->refs = 0;
+		msg->len = count;
+		memcpy(msg->data, buf, count);
+		uring_queue_msg(data, msg);
+		return;
+	}
+
+	begin = trace_begin();
+	if(bulk_write(data->socket, buf, count) < 0 && errno != EPIPE) {
+		ERR("write");
+	}
+	trace_end("write", begin);
+}
+
+/*
+* Sends message gathered from several buffers to the session's client with a single write.
+*
+* @data:   session of the client
+* @iov:    buffers of the message (may be modified)
+* @iovcnt: number of buffers
+*/
+void session_writev(player_th_data* data, struct iovec* iov, int iovcnt) {
+	uring_msg* msg;
+	size_t count = 0;
+	long begin;
+	int i;
+
+	if(data->holding) {
+		for(i = 0; i < iovcnt; ++i) {
+			session_append_held(data, (char*) iov[i].iov_base, iov[i].iov_len);
+		}
+		return;
+	}
+	if(data->loop) {
+		for(i = 0; i < iovcnt; ++i) {
+			count += iov[i].iov_len;
+		}
+		if( (msg = (uring_msg*) malloc(sizeof(uring_msg) + count)) == NULL) {
+			ERR("malloc");
+		}
+		msg->refs = 0;
+		msg->len = count;
+		for(i = 0, count = 0; i < iovcnt; ++i) {
+			memcpy(msg->data + count, iov[i].iov_base, iov[i].iov_len);
+			count += iov[i].iov_len;
+		}
+		uring_queue_msg(data, msg);
+		return;
+	}
+
+	begin = trace_begin();
+	if(bulk_writev(data->socket, iov, iovcnt) < 0 && errno != EPIPE) {
+		ERR("writev");
+	}
+	trace_end("write", begin);
+}
+
+/*
+* Holds back replies of the session until session_release.
+* Writes of the threads backend block on a client that stops reading, they must not happen under the ledger lock.
+*/
+void session_hold(player_th_data* data) {
+	data->holding = 1;
+}
+
+/*
+* Writes replies held back since session_hold, called after the ledger lock is released.
+*/
+void session_release(player_th_data* data) {
+	data->holding = 0;
+	if(data->held_len > 0) {
+		session_write(data, data->held, data->held_len);
+		data->held_len = 0;
+	}
+}
+
+/*
+* Opens the segment live race state is exported to.
+* Segment left by a previous build keeps its sequence, so readers mapping it stay valid across upgrades.
+*
+* @ex:   export being set up (zeroed, sessions may already use it)
+* @name: name of the segment (empty disables export)
+* @race: race state being exported
+*/
+void export_init(track_export* ex, char* name, race_args* race) {
+	int fd;
+	track_shm* shm;
+
+	ex->race = race;
+	if(!name[0]) {
+		return;
+	}
+	strncpy(ex->name, name, NAME_MAX);
+	if( (fd = shm_open(ex->name, O_CREAT | O_RDWR, 0644)) < 0) {
+		ERR("shm_open");
+	}
+	if(ftruncate(fd, sizeof(track_shm)) < 0) {
+		ERR("ftruncate");
+	}
+	if( (shm = (track_shm*) mmap(NULL, sizeof(track_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ERR("mmap");
+	}
+	if(TEMP_FAILURE_RETRY(close(fd)) < 0) {
+		ERR("close");
+	}
+	if(shm->magic != TRACK_SHM_MAGIC || shm->version != TRACK_SHM_VERSION) {
+		memset(shm, 0, sizeof(track_shm));
+		shm->magic = TRACK_SHM_MAGIC;
+		shm->version = TRACK_SHM_VERSION;
+	} else if(shm->seq & 1) {
+		/* Previous writer died in the middle of an update */
+		__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+	}
+	/* Sessions may already be betting */
+	if(pthread_mutex_lock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	ex->shm = shm;
+	if(pthread_mutex_unlock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+void export_destroy(track_export* ex) {
+	if(!ex->shm) {
+		return;
+	}
+	if(munmap(ex->shm, sizeof(track_shm)) < 0) {
+		ERR("munmap");
+	}
+	shm_unlink(ex->name);
+}
+
+/*
+* Seqlock write side, writers are serialized by bank_mutex.
+*/
+void export_begin(track_shm* shm) {
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void export_end(track_shm* shm) {
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Returns slot of the horse in the exported field, -1 if it does not run.
+*/
+int export_slot(track_export* ex, horse* h) {
+	int i;
+
+	for(i = 0; h && i < MAX_HORSES_PER_RACE; ++i) {
+		if(ex->slots[i] == h) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+* Exports a freshly drawn field together with pools of tickets already placed on it.
+*/
+void export_field(track_export* ex) {
+	race_args* race = ex->race;
+	bet_book* book = race->book;
+	track_shm* shm = ex->shm;
+	horse* h;
+	int i, slot;
+
+	if(!shm) {
+		return;
+	}
+	if(pthread_mutex_lock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	export_begin(shm);
+	shm->racing = 0;
+	shm->tick = 0;
+	shm->horse_count = 0;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		h = ex->slots[i] = (*race->curr_running_horses)[i];
+		memset(&shm->field[i], 0, sizeof(track_shm_horse));
+		if(h) {
+			memcpy(shm->field[i].name, h->name, MAX_NAME_LEN);
+			shm->field[i].distance = h->distance_run;
+			shm->field[i].rest_factor = h->rest_factor;
+			shm->field[i].running = h->running;
+			++shm->horse_count;
+		}
+	}
+	for(i = 0; i < book->count; ++i) {
+		if(book->type[i] == BET_WIN && (slot = export_slot(ex, &race->horses[book->sel[0][i]])) >= 0) {
+			shm->field[slot].pool += book->stake[i];
+		}
+	}
+	shm->bank = *race->bank;
+	shm->tickets = book->count;
+	if(*race->winner) {
+		memcpy(shm->last_winner, (*race->winner)->name, MAX_NAME_LEN);
+	}
+	export_end(shm);
+	if(pthread_mutex_unlock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Exports the start of the upcoming race.
+*/
+void export_countdown(track_export* ex, time_t next_start) {
+	if(!ex->shm) {
+		return;
+	}
+	if(pthread_mutex_lock(ex->race->bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	export_begin(ex->shm);
+	ex->shm->next_start = next_start;
+	export_end(ex->shm);
+	if(pthread_mutex_unlock(ex->race->bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Exports positions of the field after a race turn.
+*
+* @ex:   export
+* @tick: number of turns run, 0 starts a new race
+*/
+void export_tick(track_export* ex, unsigned long tick) {
+	race_args* race = ex->race;
+	track_shm* shm = ex->shm;
+	horse* h;
+	int i;
+
+	if(!shm) {
+		return;
+	}
+	if(pthread_mutex_lock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	export_begin(shm);
+	if(tick == 0) {
+		++shm->race;
+	}
+	shm->racing = 1;
+	shm->tick = tick;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if( (h = ex->slots[i]) ) {
+			shm->field[i].distance = h->distance_run;
+			shm->field[i].rest_factor = h->rest_factor;
+			shm->field[i].running = h->running;
+		}
+	}
+	if(*race->winner) {
+		memcpy(shm->last_winner, (*race->winner)->name, MAX_NAME_LEN);
+	}
+	export_end(shm);
+	if(pthread_mutex_unlock(race->bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Exports pools after a ticket was placed, bank_mutex must be held.
+* Horse pools only count win tickets.
+*
+* @ex:    export
+* @win:   horse of a win ticket (NULL for other bet types)
+* @stake: money bet
+* @bank:  money in the bank
+* @count: number of tickets
+*/
+void export_bet_locked(track_export* ex, horse* win, int stake, int bank, int count) {
+	track_shm* shm = ex->shm;
+	int i;
+
+	if(!shm) {
+		return;
+	}
+	export_begin(shm);
+	if( (i = export_slot(ex, win)) >= 0) {
+		shm->field[i].pool += stake;
+	}
+	shm->bank = bank;
+	shm->tickets = count;
+	export_end(shm);
+}
+
+int replica_enabled(replica_state* r) {
+	return r && r->listen_fd >= 0;
+}
+
+/*
+* Clears a record and sets its type, no horses are picked.
+*/
+replica_record* replica_rec(replica_record* rec, int type) {
+	int i;
+
+	memset(rec, 0, sizeof(replica_record));
+	rec->type = type;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		rec->horses[i] = -1;
+	}
+	return rec;
+}
+
+void replica_fill_player(replica_record* rec, int index, player* pl) {
+	rec->index = index;
+	rec->money = pl->money;
+	rec->token = pl->token;
+	memcpy(rec->name, pl->name, MAX_NAME_LEN);
+}
+
+/*
+* Fills field of the record with positions of the horses.
+*
+* @horses: array of all horses
+* @field:  horses of the upcoming/current race
+*/
+void replica_fill_field(replica_record* rec, horse* horses, horse** field) {
+	int i;
+
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if(field[i]) {
+			rec->horses[i] = field[i] - horses;
+			rec->distance[i] = field[i]->distance_run;
+			rec->rest[i] = field[i]->rest_factor;
+		}
+	}
+}
+
+/*
+* Fills the record with a ticket of the book, bank_mutex must be held.
+*/
+void replica_fill_ticket(replica_record* rec, bet_book* book, int ticket, player* pl, int bank) {
+	int i;
+
+	rec->index = book->player[ticket];
+	rec->arg = book->type[ticket];
+	rec->stake = book->stake[ticket];
+	for(i = 0; i < BET_PLACES; ++i) {
+		rec->horses[i] = book->sel[i][ticket];
+	}
+	rec->money = pl->money;
+	rec->bank = bank;
+}
+
+/*
+* Appends a record to the queue of the connected standby, r->mutex must be held.
+*
+* Returns sequence number of the record, 0 when no standby is connected.
+*/
+uint64_t replica_append_locked(replica_state* r, replica_record* rec) {
+	size_t capacity;
+
+	if(r->fd < 0) {
+		return 0;
+	}
+	if(r->queued + sizeof(replica_record) > r->capacity) {
+		capacity = (r->capacity) ? 2 * r->capacity : REPLICA_BATCH * sizeof(replica_record);
+		if( (r->queue = (char*) realloc(r->queue, capacity)) == NULL) {
+			ERR("realloc");
+		}
+		r->capacity = capacity;
+	}
+	memcpy(r->queue + r->queued, rec, sizeof(replica_record));
+	r->queued += sizeof(replica_record);
+	return ++r->seq;
+}
+
+/*
+* Queues a record for the standby and wakes the sender.
+* A standby falling REPLICA_QUEUE_LIMIT bytes behind is disconnected rather than stalling the leader.
+*
+* Returns sequence number of the record, 0 when it is not replicated.
+*/
+uint64_t replica_queue(replica_state* r, replica_record* rec) {
+	uint64_t seq = 0;
+
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(r->fd >= 0 && r->queued >= REPLICA_QUEUE_LIMIT) {
+		fprintf(stderr, "Standby fell behind, disconnecting it.\n");
+		shutdown(r->fd, SHUT_RDWR);
+	} else {
+		seq = replica_append_locked(r, rec);
+	}
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	if(seq && eventfd_write(r->wake_fd, 1) < 0) {
+		ERR("eventfd_write");
+	}
+	return seq;
+}
+
+/*
+* Accounts a bet's wait for the standby in the metrics.
+*
+* @waited:    time the bet waited
+* @timed_out: tells whether the wait ended at replica->ack_ms without the acknowledgement
+*/
+void replica_ack_waited(server_metrics* metrics, long waited, int timed_out) {
+	sched_stats* stats = &metrics->replica_acks;
+	unsigned long max;
+
+	if(timed_out) {
+		__atomic_fetch_add(&metrics->replica_timeouts, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&stats->wakeups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->total_ns, waited, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	while((unsigned long) waited > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, waited, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+* Waits until the standby applied the record or replica->ack_ms passed.
+*
+* @seq: sequence number returned by replica_queue
+*/
+void replica_wait(replica_state* r, uint64_t seq, server_metrics* metrics) {
+	long begin, deadline;
+	struct timespec ts;
+	int err = 0;
+
+	if(seq == 0 || r->ack_ms <= 0) {
+		return;
+	}
+	begin = monotonic_ns();
+	deadline = begin + r->ack_ms * (NSEC_PER_SEC / 1000);
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	while(r->fd >= 0 && r->acked < seq && err != ETIMEDOUT) {
+		if( (err = pthread_cond_timedwait(&r->acked_cond, &r->mutex, &ts)) != 0 && err != ETIMEDOUT) {
+			errno = err;
+			ERR("pthread_cond_timedwait");
+		}
+	}
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	replica_ack_waited(metrics, monotonic_ns() - begin, err == ETIMEDOUT);
+}
+
+void replica_player(replica_state* r, int index, player* pl) {
+	replica_record rec;
+
+	if(replica_enabled(r)) {
+		replica_fill_player(replica_rec(&rec, REPLICA_PLAYER), index, pl);
+		replica_queue(r, &rec);
+	}
+}
+
+/*
+* Replicates player's balance, bank_mutex must be held.
+*/
+void replica_money(replica_state* r, int index, player* pl) {
+	replica_record rec;
+
+	if(replica_enabled(r)) {
+		replica_rec(&rec, REPLICA_MONEY);
+		rec.index = index;
+		rec.money = pl->money;
+		replica_queue(r, &rec);
+	}
+}
+
+/*
+* Replicates the last ticket of the book, bank_mutex must be held.
+*
+* Returns sequence number to wait for with replica_wait.
+*/
+uint64_t replica_bet(replica_state* r, bet_book* book, player* pl, int bank) {
+	replica_record rec;
+
+	if(!replica_enabled(r)) {
+		return 0;
+	}
+	replica_fill_ticket(replica_rec(&rec, REPLICA_BET), book, book->count - 1, pl, bank);
+	return replica_queue(r, &rec);
+}
+
+/*
+* Replicates a field or its positions after a race turn.
+*
+* @type: REPLICA_FIELD or REPLICA_TICK
+* @tick: turns run
+*/
+void replica_race(replica_state* r, int type, race_args* race, unsigned long tick) {
+	replica_record rec;
+
+	if(replica_enabled(r)) {
+		replica_fill_field(replica_rec(&rec, type), race->horses, *race->curr_running_horses);
+		rec.arg = tick;
+		replica_queue(r, &rec);
+	}
+}
+
+void replica_countdown(replica_state* r, time_t next_start) {
+	replica_record rec;
+
+	if(replica_enabled(r)) {
+		replica_rec(&rec, REPLICA_COUNTDOWN)->next_start = next_start;
+		replica_queue(r, &rec);
+	}
+}
+
+/*
+* Replicates the finish order the race was settled with, bank_mutex must be held.
+* The standby settles its copy of the book the same way.
+*/
+void replica_settle(replica_state* r, int16_t* order) {
+	replica_record rec;
+
+	if(replica_enabled(r)) {
+		memcpy(replica_rec(&rec, REPLICA_SETTLE)->horses, order, BET_PLACES * sizeof(int16_t));
+		replica_queue(r, &rec);
+	}
+}
+
+/*
+* Tells the standby the leader stops on purpose, so it follows the next build instead of taking over.
+* Waits up to REPLICA_END_WAIT_MS for the standby to apply everything queued.
+*/
+void replica_end(replica_state* r) {
+	replica_record rec;
+	struct timespec ts;
+	uint64_t seq;
+	long deadline;
+	int err = 0;
+
+	if(!replica_enabled(r) || (seq = replica_queue(r, replica_rec(&rec, REPLICA_END))) == 0) {
+		return;
+	}
+	deadline = monotonic_ns() + REPLICA_END_WAIT_MS * (NSEC_PER_SEC / 1000);
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	while(r->fd >= 0 && r->acked < seq && err != ETIMEDOUT) {
+		if( (err = pthread_cond_timedwait(&r->acked_cond, &r->mutex, &ts)) != 0 && err != ETIMEDOUT) {
+			errno = err;
+			ERR("pthread_cond_timedwait");
+		}
+	}
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Stops or resumes accepting the standby while the listening socket is being passed to the next build.
+*
+* @handed: 1 stops accepting, 0 resumes after an abandoned handoff
+*/
+void replica_hand_over(replica_state* r, short handed) {
+	__atomic_store_n(&r->handed_over, handed, __ATOMIC_RELEASE);
+	if(r->wake_fd >= 0 && eventfd_write(r->wake_fd, 1) < 0) {
+		ERR("eventfd_write");
+	}
+}
+
+/*
+* Deposits money unless balances and the bank would hold more than MONEY_LIMIT together.
+* Bets and payouts only move money between them, so balances, the bank, pools and payouts
+* can never exceed MONEY_LIMIT and 32 bits hold every one of them.
+*/
+void deposit(player_th_data* data, player* pl, int deposit) {
+	long long total;
+	int i;
+
+	if(deposit < 0) {
+		session_write(data, CANT_DEP_NEGATIVE_MSG, strlen(CANT_DEP_NEGATIVE_MSG));
+		return;
+	}
+	/* Balances change under bank_mutex so the standby sees them in the same order as payouts */
+	pthread_mutex_lock(data->bank_mutex);
+	total = (long long) *data->bank + deposit;
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if(data->players[i]) {
+			total += data->players[i]->money;
+		}
+	}
+	if(total > MONEY_LIMIT) {
+		pthread_mutex_unlock(data->bank_mutex);
+		session_write(data, CANT_DEP_LIMIT_MSG, strlen(CANT_DEP_LIMIT_MSG));
+		return;
+	}
+	pl->money += deposit;
+	replica_money(data->replica, data->index, pl);
+	pthread_mutex_unlock(data->bank_mutex);
+}
+
+void withdraw(player_th_data* data, player* pl, int amount) {
+	pthread_mutex_lock(data->bank_mutex);
+	if(amount < 0 || pl->money - amount < 0) {
+		pthread_mutex_unlock(data->bank_mutex);
+		session_write(data, CANT_WITHDRAW_MSG, strlen(CANT_WITHDRAW_MSG));
+		return;
+	}
+
+	pl->money -= amount;
+	replica_money(data->replica, data->index, pl);
+	pthread_mutex_unlock(data->bank_mutex);
+}
+
+/*
+* Places a ticket: "b <horse> <money>" bets on the winner, naming two or three horses
+* bets on the exact finishing order of the first places (exacta, trifecta).
+* Every bet adds a ticket, earlier tickets of the player stay in the race.
+*/
+void bet(player_th_data* data, player* pl, char* cmd, horse* horses, int horse_count, int* bank, pthread_mutex_t* bank_mutex, bet_book* book) {
+	int i, j, count, money_bet;
+	char* words[BET_PLACES + 2], *save_ptr;
+	int16_t sel[BET_PLACES];
+	uint64_t seq;
+	printf("cmd: %s\n", cmd);
+	strtok_r(cmd, " ", &save_ptr);
+	for(count = 0; count < BET_PLACES + 2 && (words[count] = strtok_r(NULL, " ", &save_ptr)); ++count);
+
+	if(count > BET_PLACES + 1) {
+		session_write(data, BAD_BET_MSG, strlen(BAD_BET_MSG));
+		return;
+	}
+	if(count < 2) {
+		session_write(data, NO_SUCH_HORSE_MSG, strlen(NO_SUCH_HORSE_MSG));
+		return;
+	}
+	money_bet = atoi(words[count - 1]);
+	if(money_bet <= 0) {
+		session_write(data, CANT_BET_NEGATIVE_MSG, strlen(CANT_BET_NEGATIVE_MSG));
+		return;
+	}
+	for(j = 0; j < count - 1; ++j) {
+		for(i = 0; i < horse_count && strcmp(words[j], horses[i].name); ++i);
+		if(i == horse_count) {
+			session_write(data, NO_SUCH_HORSE_MSG, strlen(NO_SUCH_HORSE_MSG));
+			return;
+		}
+		sel[j] = i;
+		for(i = 0; i < j; ++i) {
+			if(sel[i] == sel[j]) {
+				session_write(data, BAD_BET_MSG, strlen(BAD_BET_MSG));
+				return;
+			}
+		}
+	}
+
+	/* Balance is checked under bank_mutex, a resumed player may bet from two sessions at once */
+	pthread_mutex_lock(bank_mutex);
+	if(money_bet > pl->money) {
+		pthread_mutex_unlock(bank_mutex);
+		session_write(data, CANT_BET_MSG, strlen(CANT_BET_MSG));
+		return;
+	}
+	pl->horse_bet = &horses[sel[0]];
+	pl->money_bet = money_bet;
+	pl->money -= money_bet;
+	*bank += money_bet;
+	book_add(book, data->index, count - 2, sel, money_bet);
+	export_bet_locked(data->export, (count == 2) ? pl->horse_bet : NULL, money_bet, *bank, book->count);
+	seq = replica_bet(data->replica, book, pl, *bank);
+	pthread_mutex_unlock(bank_mutex);
+	/* Bet is acknowledged once the standby has it, or after replica->ack_ms at most */
+	if(data->loop) {
+		/* The io_uring loop parks replies of the session instead of blocking every other session */
+		data->ack_seq = seq;
+	} else {
+		replica_wait(data->replica, seq, data->metrics);
+	}
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/*
+* Writes decimal representation of the number without terminating NUL.
+*
+* @dst: destination, must hold at least 11 characters
+* @val: number to be written
+*
+* Returns number of characters written.
+*/
+size_t fmt_int(char* dst, int val) {
+	char tmp[12];
+	char* p = tmp + sizeof(tmp);
+	unsigned int u = (val < 0) ? 0U - (unsigned int) val : (unsigned int) val;
+	size_t len;
+
+	while(u >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if(u >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + u * 2, 2);
+	} else {
+		*--p = '0' + u;
+	}
+	if(val < 0) {
+		*--p = '-';
+	}
+	len = tmp + sizeof(tmp) - p;
+	memcpy(dst, p, len);
+	return len;
+}
+
+void rb_init(resp_builder* rb, char* buf, size_t cap) {
+	rb->buf = buf;
+	rb->len = 0;
+	rb->cap = cap;
+}
+
+/*
+* Appends bytes to the reply, dropping what does not fit.
+*/
+void rb_append(resp_builder* rb, const char* src, size_t len) {
+	if(len > rb->cap - rb->len) {
+		len = rb->cap - rb->len;
+	}
+	memcpy(rb->buf + rb->len, src, len);
+	rb->len += len;
+}
+
+void rb_append_str(resp_builder* rb, const char* src) {
+	rb_append(rb, src, strlen(src));
+}
+
+void rb_append_int(resp_builder* rb, int val) {
+	char num[12];
+	rb_append(rb, num, fmt_int(num, val));
+}
+
+/*
+* Renders parts of race replies that do not change during the race.
+* Called by the race thread whenever the field changes.
+*
+* @tmpl:                template to be rendered
+* @curr_running_horses: array of horses running in the upcoming race
+*/
+void render_race_template(race_template* tmpl, horse** curr_running_horses) {
+	resp_builder rb;
+	size_t name_len;
+	int i;
+
+	tmpl->count = 0;
+	rb_init(&rb, tmpl->field, sizeof(tmpl->field));
+	rb_append(&rb, NEXT_RACE_FIELD, STRLEN(NEXT_RACE_FIELD));
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if(curr_running_horses[i] == NULL) {
+			continue;
+		}
+		name_len = strlen(curr_running_horses[i]->name);
+		rb_append(&rb, "\t", 1);
+		rb_append(&rb, curr_running_horses[i]->name, name_len);
+		rb_append(&rb, "\n", 1);
+
+		memcpy(tmpl->prefix[tmpl->count], curr_running_horses[i]->name, name_len);
+		memcpy(tmpl->prefix[tmpl->count] + name_len, DISTANCE_INFIX, STRLEN(DISTANCE_INFIX));
+		tmpl->prefix_len[tmpl->count] = name_len + STRLEN(DISTANCE_INFIX);
+		tmpl->horses[tmpl->count++] = curr_running_horses[i];
+	}
+	rb_append(&rb, "\n", 1);
+	tmpl->field_len = rb.len;
+}
+
+/*
+* Renders info reply of the player.
+*
+* Returns length of the reply.
+*/
+size_t render_info(char* buf, size_t size, player* pl) {
+	resp_builder rb;
+
+	rb_init(&rb, buf, size);
+	rb_append(&rb, INFO_PREFIX, STRLEN(INFO_PREFIX));
+	rb_append_str(&rb, pl->name);
+	rb_append(&rb, INFO_MONEY, STRLEN(INFO_MONEY));
+	rb_append_int(&rb, pl->money);
+	rb_append(&rb, INFO_BET, STRLEN(INFO_BET));
+	rb_append_str(&rb, (pl->horse_bet) ? pl->horse_bet->name : "none");
+	rb_append(&rb, INFO_BET_MONEY, STRLEN(INFO_BET_MONEY));
+	rb_append_int(&rb, pl->money_bet);
+	rb_append(&rb, INFO_SUFFIX, STRLEN(INFO_SUFFIX));
+	return rb.len;
+}
+
+/*
+* Sends player info to the client.
+*
+* @data: session of the client
+* @pl:   pointer to the player
+*/
+void print_info(player_th_data* data, player* pl) {
+	char send_info[LINE_BUF];
+
+	session_write(data, send_info, render_info(send_info, LINE_BUF, pl));
+}
+
+void snapshot_init(race_snapshots* rs, race_template* tmpl, time_t* count_start, int* interval, horse** winner) {
+	memset(rs, 0, sizeof(race_snapshots));
+	rs->tmpl = tmpl;
+	rs->count_start = count_start;
+	rs->interval = interval;
+	rs->winner = winner;
+	if(pthread_mutex_init(&rs->mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
+	}
+}
+
+void snapshot_destroy(race_snapshots* rs) {
+	if(pthread_mutex_destroy(&rs->mutex) != 0) {
+		ERR("pthread_mutex_destroy");
+	}
+}
+
+/*
+* Returns published snapshot with a reference taken, or NULL if there is none.
+* Snapshot storage is never freed, a slot recycled in the meantime is detected
+* by its negative count or by the published pointer having moved on.
+*/
+race_snapshot* snapshot_acquire(race_snapshots* rs) {
+	race_snapshot* snap;
+
+	while( (snap = __atomic_load_n(&rs->current, __ATOMIC_ACQUIRE)) ) {
+		if(__atomic_fetch_add(&snap->refs, 1, __ATOMIC_ACQ_REL) >= 0 && __atomic_load_n(&rs->current, __ATOMIC_ACQUIRE) == snap) {
+			return snap;
+		}
+		__atomic_fetch_sub(&snap->refs, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void snapshot_release(race_snapshot* snap) {
+	__atomic_fetch_sub(&snap->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Renders answers to next and last race commands from the current server state
+* into a free slot and publishes it. Caller must hold rs->mutex.
+*/
+void publish_snapshot_locked(race_snapshots* rs) {
+	race_snapshot* snap, *current = rs->current;
+	resp_builder rb;
+	int i, expected;
+
+	for(i = 0; i < SNAPSHOT_SLOTS; ++i) {
+		snap = &rs->slots[i];
+		expected = 0;
+		if(snap != current && __atomic_compare_exchange_n(&snap->refs, &expected, SNAPSHOT_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if(i == SNAPSHOT_SLOTS) {
+		/* Every other slot is held by slow readers, let them render replies themselves */
+		__atomic_store_n(&rs->current, NULL, __ATOMIC_RELEASE);
+		return;
+	}
+
+	snap->next_start = *rs->count_start + *rs->interval;
+
+	rb_init(&rb, snap->next_tail, sizeof(snap->next_tail));
+	rb_append(&rb, NEXT_RACE_SUFFIX, STRLEN(NEXT_RACE_SUFFIX));
+	rb_append(&rb, rs->tmpl->field, rs->tmpl->field_len);
+	snap->next_tail_len = rb.len;
+
+	rb_init(&rb, snap->last, sizeof(snap->last));
+	if(*rs->winner) {
+		rb_append(&rb, LAST_WINNER_PREFIX, STRLEN(LAST_WINNER_PREFIX));
+		rb_append_str(&rb, (*rs->winner)->name);
+		rb_append(&rb, "\n", 1);
+	}
+	snap->last_len = rb.len;
+
+	__atomic_fetch_sub(&snap->refs, SNAPSHOT_CLAIMED, __ATOMIC_RELEASE);
+	__atomic_store_n(&rs->current, snap, __ATOMIC_RELEASE);
+}
+
+/*
+* Publishes snapshot after the state, the race start time or the winner changed.
+*/
+void publish_snapshot(race_snapshots* rs) {
+	if(pthread_mutex_lock(&rs->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	publish_snapshot_locked(rs);
+	if(pthread_mutex_unlock(&rs->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Rerenders the race template after the field changed and publishes snapshot of it.
+*/
+void publish_field(race_snapshots* rs, horse** curr_running_horses) {
+	if(pthread_mutex_lock(&rs->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	render_race_template(rs->tmpl, curr_running_horses);
+	publish_snapshot_locked(rs);
+	if(pthread_mutex_unlock(&rs->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+void next_race_time(player_th_data* data, player* pl, time_t* start_time, int* interval, race_template* tmpl) {
+	char next_race_info[LINE_BUF + sizeof(tmpl->field)];
+	char countdown[12];
+	struct iovec iov[3];
+	resp_builder rb;
+	race_snapshot* snap;
+
+	if( (snap = snapshot_acquire(data->snapshots)) ) {
+		iov[0].iov_base = NEXT_RACE_PREFIX;
+		iov[0].iov_len = STRLEN(NEXT_RACE_PREFIX);
+		iov[1].iov_base = countdown;
+		iov[1].iov_len = fmt_int(countdown, (int) (snap->next_start - time(NULL)));
+		iov[2].iov_base = snap->next_tail;
+		iov[2].iov_len = snap->next_tail_len;
+		session_writev(data, iov, 3);
+		snapshot_release(snap);
+		return;
+	}
+
+	rb_init(&rb, next_race_info, sizeof(next_race_info));
+	rb_append(&rb, NEXT_RACE_PREFIX, STRLEN(NEXT_RACE_PREFIX));
+	rb_append_int(&rb, *interval - (int) (time(NULL) - (*start_time)));
+	rb_append(&rb, NEXT_RACE_SUFFIX, STRLEN(NEXT_RACE_SUFFIX));
+	rb_append(&rb, tmpl->field, tmpl->field_len);
+	session_write(data, next_race_info, rb.len);
+}
+
+void last_race_info(player_th_data* data, player* pl, horse* winner) {
+	char send_info[LINE_BUF];
+	resp_builder rb;
+	race_snapshot* snap;
+
+	if( (snap = snapshot_acquire(data->snapshots)) ) {
+		if(snap->last_len > 0) {
+			session_write(data, snap->last, snap->last_len);
+		}
+		snapshot_release(snap);
+		return;
+	}
+
+	if(winner == NULL) {
+		return;
+	}
+
+	rb_init(&rb, send_info, LINE_BUF);
+	rb_append(&rb, LAST_WINNER_PREFIX, STRLEN(LAST_WINNER_PREFIX));
+	rb_append_str(&rb, winner->name);
+	rb_append(&rb, "\n", 1);
+	session_write(data, send_info, rb.len);
+}
+
+int get_value(char* buf) {
+	char* second;
+	
+	second = strchr(buf, ' ');
+
+	if(second && *(second + 1)) {
+		printf("%s\n", second + 1);
+		return atoi(second+1);
+	}
+	return 0;
+}
+
+/*
+* Renders distances run by horses in the current race.
+* Only the distances are formatted, names come prerendered from the race template.
+*
+* @buf:    destination buffer
+* @size:   size of the destination buffer
+* @tmpl:   template of the current race
+* @winner: winner of the race (NULL while the race lasts)
+*
+* Returns length of the rendered status.
+*/
+size_t render_race_status(char* buf, size_t size, race_template* tmpl, horse* winner) {
+	resp_builder rb;
+	int i;
+
+	rb_init(&rb, buf, size);
+	for(i = 0; !winner && i < tmpl->count; ++i) {
+		rb_append(&rb, tmpl->prefix[i], tmpl->prefix_len[i]);
+		rb_append_int(&rb, tmpl->horses[i]->distance_run);
+		rb_append(&rb, "\n", 1);
+	}
+	rb_append(&rb, "\n", 1);
+	return rb.len;
+}
+
+/*
+* Sleeps until the absolute CLOCK_MONOTONIC deadline.
+*
+* Returns 0 if the deadline was reached, -1 if a signal interrupted the sleep.
+*/
+int sleep_until(long deadline) {
+	struct timespec ts = {deadline / NSEC_PER_SEC, deadline % NSEC_PER_SEC};
+	int err;
+
+	if( (err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) != 0) {
+		if(err == EINTR) {
+			return -1;
+		}
+		errno = err;
+		ERR("clock_nanosleep");
+	}
+	return 0;
+}
+
+/*
+* Records how late a thread of the role woke up.
+*
+* @metrics: server counters
+* @role:    role of the calling thread (ROLE_*)
+* @since:   time the thread should have been running since
+*/
+void sched_record(server_metrics* metrics, int role, long since) {
+	sched_stats* stats = &metrics->sched[role];
+	long latency = monotonic_ns() - since;
+	unsigned long max;
+
+	/* Wakeups caused by shutdown are not scheduling delays */
+	if(since == 0 || latency < 0 || exit_flag) {
+		return;
+	}
+	__atomic_fetch_add(&stats->wakeups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->total_ns, latency, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	while((unsigned long) latency > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+* Records wakeup latency of a thread woken by the last race turn.
+*/
+void sched_record_tick(server_metrics* metrics, int role) {
+	sched_record(metrics, role, __atomic_load_n(&metrics->tick_ns, __ATOMIC_ACQUIRE));
+}
+
+void notify_race_info(player_th_data* data) {
+	char race_status[LINE_BUF * MAX_HORSES_PER_RACE];
+	size_t len;
+	long begin;
+
+	while(*data->state != STATE_NOT_RACING && !exit_flag) {
+		begin = trace_begin();
+		pthread_mutex_lock(data->mutex);
+		if(pthread_cond_wait(data->cond, data->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		if(pthread_mutex_unlock(data->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		sched_record_tick(data->metrics, ROLE_IO);
+		trace_end("wait turn", begin);
+		len = render_race_status(race_status, LINE_BUF * MAX_HORSES_PER_RACE, data->tmpl, *data->winner);
+		session_write(data, race_status, len);
+	}
+}
+
+void tick_ring_init(tick_ring* ring) {
+	memset(ring, 0, sizeof(tick_ring));
+	if(pthread_mutex_init(&ring->mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
+	}
+}
+
+void tick_ring_destroy(tick_ring* ring) {
+	pthread_mutex_destroy(&ring->mutex);
+}
+
+/*
+* Records the race status after a turn, rendered the way it is broadcast to sessions.
+* Runs on the race thread while horses wait for the next turn.
+*
+* @first: turn starts a new race (==1 if so)
+*/
+void tick_ring_record(tick_ring* ring, race_template* tmpl, horse* winner, int first) {
+	tick_entry* e;
+
+	if(pthread_mutex_lock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	e = &ring->slots[++ring->seq % TICK_RING_SLOTS];
+	e->seq = ring->seq;
+	e->len = render_race_status(e->buf, sizeof(e->buf), tmpl, winner);
+	if(first) {
+		ring->race_first = ring->seq;
+		ring->racing = 1;
+	}
+	if(pthread_mutex_unlock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+void tick_ring_end(tick_ring* ring) {
+	if(pthread_mutex_lock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	ring->racing = 0;
+	if(pthread_mutex_unlock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Sends turns of the race in progress still kept by the ring, oldest first.
+* Every turn is a full status, so a client missing some of them ends up with the whole race.
+* Turns are copied out under the mutex and written after it is released.
+*/
+void tick_ring_replay(tick_ring* ring, player_th_data* data) {
+	uint64_t first, seq;
+	size_t len = 0;
+	char* buf = NULL;
+
+	if(pthread_mutex_lock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(ring->racing) {
+		first = (ring->seq - ring->race_first >= TICK_RING_SLOTS) ? ring->seq - TICK_RING_SLOTS + 1 : ring->race_first;
+		for(seq = first; seq <= ring->seq; ++seq) {
+			len += ring->slots[seq % TICK_RING_SLOTS].len;
+		}
+		if( (buf = (char*) malloc(len)) == NULL) {
+			ERR("malloc");
+		}
+		len = 0;
+		for(seq = first; seq <= ring->seq; ++seq) {
+			memcpy(buf + len, ring->slots[seq % TICK_RING_SLOTS].buf, ring->slots[seq % TICK_RING_SLOTS].len);
+			len += ring->slots[seq % TICK_RING_SLOTS].len;
+		}
+	}
+	if(pthread_mutex_unlock(&ring->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	if(len > 0) {
+		session_write(data, buf, len);
+	}
+	free(buf);
+}
+
+/*
+* Logs the session in with the first line it sent. A name registers a new player, who gets a resume token.
+* "resume <token>" reattaches the session to the player the token was issued to and replays turns
+* of the race in progress. The token is used up, the session gets a new one, so a session left behind
+* on a broken link cannot be resumed twice.
+*
+* Returns 0 when the line was handled (data->index stays -1 if registration failed), -1 when the session
+* should send another login.
+*/
+int session_login(player_th_data* data, char* buf, int len) {
+	unsigned long long token;
+	char msg[LINE_BUF];
+	player* pl;
+	char* end;
+	int slot;
+
+	if(!strncmp(buf, RESUME_CMD, strlen(RESUME_CMD))) {
+		token = strtoull(buf + strlen(RESUME_CMD), &end, 16);
+		slot = token >> TOKEN_SLOT_SHIFT;
+		if(end == buf + strlen(RESUME_CMD) || slot >= MAX_PLAYERS || (pl = data->players[slot]) == NULL || pl->token != token) {
+			session_write(data, BAD_TOKEN_MSG, strlen(BAD_TOKEN_MSG));
+			return -1;
+		}
+		data->index = slot;
+		pthread_mutex_lock(data->bank_mutex);
+		pl->token = new_token(slot);
+		replica_player(data->replica, slot, pl);
+		pthread_mutex_unlock(data->bank_mutex);
+		__atomic_fetch_add(&data->metrics->resumes, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "Player %s resumed.\n", pl->name);
+		session_write(data, RESUMED_MSG, strlen(RESUMED_MSG));
+		len = snprintf(msg, LINE_BUF, RESUME_TOKEN_MSG "%016llx\n", (unsigned long long) pl->token);
+		session_write(data, msg, len);
+		tick_ring_replay(data->ticks, data);
+		return 0;
+	}
+	if( (data->index = register_player(data->players, MAX_PLAYERS, buf, len)) >= 0) {
+		pl = data->players[data->index];
+		replica_player(data->replica, data->index, pl);
+		len = snprintf(msg, LINE_BUF, RESUME_TOKEN_MSG "%016llx\n", (unsigned long long) pl->token);
+		session_write(data, msg, len);
+	}
+	return 0;
+}
+
+void rate_limiter_init(rate_limiter* limiter, server_conf* conf) {
+	int i;
+
+	limiter->cmd = conf->cmd;
+	limiter->bet = conf->bet;
+	limiter->ip_cmd = conf->ip_cmd;
+	limiter->ip_bet = conf->ip_bet;
+	if( (limiter->ips = (rate_ip_entry*) calloc(RATE_IP_SLOTS, sizeof(rate_ip_entry))) == NULL) {
+		ERR("calloc");
+	}
+	for(i = 0; i < RATE_IP_LOCKS; ++i) {
+		if(pthread_mutex_init(&limiter->locks[i], NULL) != 0) {
+			ERR("pthread_mutex_init");
+		}
+	}
+}
+
+void rate_limiter_destroy(rate_limiter* limiter) {
+	int i;
+
+	for(i = 0; i < RATE_IP_LOCKS; ++i) {
+		if(pthread_mutex_destroy(&limiter->locks[i]) != 0) {
+			ERR("pthread_mutex_destroy");
+		}
+	}
+	free(limiter->ips);
+}
+
+void bucket_init(token_bucket* b, rate_limit* limit, double now) {
+	b->tokens = limit->burst;
+	b->last = now;
+}
+
+/*
+* Takes one token from the bucket.
+*
+* Returns 1 if the token was available (or the limit is disabled), 0 otherwise.
+*/
+int bucket_take(token_bucket* b, rate_limit* limit, double now) {
+	if(limit->rate <= 0) {
+		return 1;
+	}
+	b->tokens += (now - b->last) * limit->rate;
+	if(b->tokens > limit->burst) {
+		b->tokens = limit->burst;
+	}
+	b->last = now;
+	if(b->tokens < 1) {
+		return 0;
+	}
+	b->tokens -= 1;
+	return 1;
+}
+
+/*
+* Takes one token from the bucket of the client address.
+* Slots are direct mapped by the high bits of a multiplicative hash, which depend on the whole address.
+* An address taking over a slot starts with an empty bucket refilled since the slot was last used,
+* so colliding clients cannot reset each other's limits, while a long idle slot comes back full.
+*/
+int ip_bucket_take(rate_limiter* limiter, in_addr_t ip, int is_bet, double now) {
+	unsigned slot = (uint32_t) (ntohl(ip) * 2654435761U) >> (32 - RATE_IP_BITS);
+	rate_ip_entry* entry = &limiter->ips[slot];
+	pthread_mutex_t* lock = &limiter->locks[slot % RATE_IP_LOCKS];
+	int ok;
+
+	if(pthread_mutex_lock(lock) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(entry->ip != ip) {
+		entry->ip = ip;
+		entry->cmd.tokens = 0;
+		entry->bet.tokens = 0;
+	}
+	ok = bucket_take(&entry->cmd, &limiter->ip_cmd, now) && (!is_bet || bucket_take(&entry->bet, &limiter->ip_bet, now));
+	if(pthread_mutex_unlock(lock) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	return ok;
+}
+
+double monotonic_now(void) {
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) < 0) {
+		ERR("clock_gettime");
+	}
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+* Checks command against session and address rate limits before it is parsed.
+* Client is told to slow down once per run of dropped commands.
+*
+* Returns 1 if the command may be executed, 0 if it has to be dropped.
+*/
+int admit_cmd(player_th_data* data, char* buf) {
+	rate_limiter* limiter = data->limiter;
+	int is_bet = (buf[0] == 'b');
+	double now;
+
+	if(data->local) {
+		__atomic_fetch_add(&data->metrics->commands, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	now = monotonic_now();
+	if(bucket_take(&data->cmd_bucket, &limiter->cmd, now) && (!is_bet || bucket_take(&data->bet_bucket, &limiter->bet, now)) &&
+		(data->peer == 0 || ip_bucket_take(limiter, data->peer, is_bet, now))) {
+		data->throttled = 0;
+		__atomic_fetch_add(&data->metrics->commands, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	__atomic_fetch_add(is_bet ? &data->metrics->rejected_bets : &data->metrics->rejected_cmds, 1, __ATOMIC_RELAXED);
+	if(!data->throttled) {
+		data->throttled = 1;
+		session_write(data, RATE_LIMITED_MSG, STRLEN(RATE_LIMITED_MSG));
+	}
+	return 0;
+}
+
+/*
+* Returns name of the command in traces.
+*/
+const char* trace_cmd_name(char cmd) {
+	switch(cmd) {
+		case 'd':
+			return "cmd deposit";
+		case 'w':
+			return "cmd withdraw";
+		case 'i':
+			return "cmd info";
+		case 'n':
+			return "cmd next";
+		case 'l':
+			return "cmd last";
+		case 'b':
+			return "cmd bet";
+		default:
+			return "cmd unknown";
+	}
+}
+
+/*
+* Executes one command received from the client.
+*
+* @data: session of the client
+* @buf:  NUL terminated command
+*/
+void route_cmd(player_th_data* data, char* buf) {
+	player** players = data->players;
+	int index = data->index;
+	long begin;
+
+	if(!admit_cmd(data, buf)) {
+		return;
+	}
+
+	begin = trace_begin();
+	switch(buf[0]) {
+		case 'd':
+			/* deposit */
+			deposit(data, players[index], get_value(buf));
+			break;
+		case 'w':
+			/* withdraw */
+			withdraw(data, players[index], get_value(buf));
+			break;
+		case 'i':
+			/* info */
+			print_info(data, players[index]);
+			break;
+		case 'n':
+			/* next */
+			next_race_time(data, players[index], data->time, data->interval, data->tmpl);
+			break;
+		case 'l':
+			/* last */
+			last_race_info(data, players[index], *data->winner);
+			break;
+		case 'b':
+			/* bet */
+			bet(data, players[index], buf, data->horses, data->horse_count, data->bank, data->bank_mutex, data->book);
+			break;
+		default:
+			session_write(data, UNWN_CMD_MSG, strlen(UNWN_CMD_MSG));
+			break;
+	}		
+	trace_end(trace_cmd_name(buf[0]), begin);
+}
+
+/*
+* Pins the calling connection thread to the CPUs of the IO role.
+* A list naming only absent or offline CPUs is reported and leaves the thread unpinned.
+*
+* @role: placement of connection threads
+*/
+void pin_io_thread(thread_role* role) {
+	int err;
+
+	if(role->pinned && (err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &role->cpus)) != 0) {
+		fprintf(stderr, "Cannot pin connection thread: %s\n", strerror(err));
+	}
+}
+
+/**
+* Handles one connection (always runs on separate thread)
+* @th_data: thread argument, see: @player_th_data structure.
+*/
+void* handle_connection(void* th_data) {
+	player_th_data* data = (player_th_data*) th_data;
+	int socket = data->socket, count, result;
+	char buf[BUF_SIZE + 1];
+	fd_set read_set;
+	struct timeval tv, ttv = {0, 500000};
+	char trace_name[TRACE_NAME_LEN];
+	struct pollfd pfd = {socket, POLLIN, 0};
+
+	memset(buf, 0, BUF_SIZE + 1);
+	snprintf(trace_name, TRACE_NAME_LEN, "session %d", socket);
+	trace_thread(trace_name);
+	pin_io_thread(data->io_role);
+
+	if(!data->adopted) {
+		session_write(data, ENTER_LOGIN_MSG, strlen(ENTER_LOGIN_MSG));
+	}
+
+	for(result = -1; data->index < 0 && result < 0; memset(buf, 0, BUF_SIZE)) {
+		/* Login is read under the ledger lock, a handoff must not catch it half processed */
+		if(TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0) {
+			ERR("poll");
+		}
+		ledger_lock(data->handoff);
+		if( (count = read(socket, buf, BUF_SIZE)) < 0) {
+			ERR("read");
+		}
+		
+		if(count == 0) {
+			ledger_unlock(data->handoff);
+			fprintf(stderr, "Connection closed.\n");
+			handoff_remove_session(data->handoff, data);
+			free(data->held);
+			pool_free(POOL_SESSIONS, th_data);
+			pool_thread_flush();
+			trace_thread_exit();
+			pthread_exit(NULL);
+		}
+
+		/* Login replies include the replay of the race in progress, they are written once the lock is released */
+		session_hold(data);
+		result = session_login(data, buf, strlen(buf));
+		ledger_unlock(data->handoff);
+		session_release(data);
+	}
+	
+	notify_race_info(data);
+
+	FD_ZERO(&read_set);
+	FD_SET(socket, &read_set);
+	count = 1;
+	tv = ttv;
+	while(( (result = select(socket + 1, &read_set, NULL, NULL, &tv) || count)) && !exit_flag) {
+		if(result < 0 && errno != EINTR) {
+			ERR("select");
+		}
+		tv = ttv;
+		if(FD_ISSET(socket, &read_set)) {
+			ledger_lock(data->handoff);
+			if( (count = read(socket, buf, BUF_SIZE)) < 0) {
+				ERR("read");
+			}
+			if(count == 0) {
+				ledger_unlock(data->handoff);
+				break;
+			}
+			session_hold(data);
+			route_cmd(data, buf);
+			ledger_unlock(data->handoff);
+			session_release(data);
+			memset(buf, 0, BUF_SIZE);
+		} else {
+			notify_race_info(data);
+		}
+		FD_ZERO(&read_set);
+		FD_SET(socket, &read_set);
+	}
+
+	fprintf(stderr, "Connection ended.\n");
+	handoff_remove_session(data->handoff, data);
+	free(data->held);
+	pool_free(POOL_SESSIONS, th_data);
+	pool_thread_flush();
+	trace_thread_exit();
+	pthread_exit(NULL);
+}
+
+int make_socket(uint16_t port) {
+	struct sockaddr_in name;
+	struct timespec ts = {0, BIND_RETRY_MS * (NSEC_PER_SEC / 1000)};
+	int sock, t = 1, tries = 0;
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if(sock < 0) {
+		ERR("socket");
+	}
+
+	name.sin_family = AF_INET;
+	name.sin_port = htons(port);
+	name.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)) < 0) {
+		ERR("setsockopt");
+	}
+	/* A process that just died (e.g. the leader a standby takes over from) may still hold the port for a moment */
+	while(bind(sock, (struct sockaddr*) &name, sizeof(name)) < 0) {
+		if(errno != EADDRINUSE || ++tries == BIND_RETRIES) {
+			ERR("bind");
+		}
+		nanosleep(&ts, NULL);
+	}
+	if(tries > 0) {
+		fprintf(stderr, "Port was busy for %d ms.\n", tries * BIND_RETRY_MS);
+	}
+	if(listen(sock, BACKLOG) < 0) {
+		ERR("listen");
+	}
+	
+	return sock;
+}
+
+/*
+* Fills unix socket address of the path.
+*
+* @path: path of the socket, leading '@' selects the abstract namespace
+*
+* Returns length of the address.
+*/
+socklen_t local_address(struct sockaddr_un* name, char* path) {
+	socklen_t len;
+
+	memset(name, 0, sizeof(struct sockaddr_un));
+	name->sun_family = AF_UNIX;
+	strncpy(name->sun_path, path, sizeof(name->sun_path) - 1);
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(name->sun_path);
+	if(path[0] == '@') {
+		/* Abstract names are not NUL terminated and vanish with the socket */
+		name->sun_path[0] = '\0';
+		return len;
+	}
+	return len + 1;
+}
+
+/*
+* Creates unix listening socket for co-located clients.
+*
+* @path: path of the socket, leading '@' selects the abstract namespace
+* @mode: permissions of a socket file (abstract names have none)
+*/
+int make_local_socket(char* path, mode_t mode) {
+	struct sockaddr_un name;
+	socklen_t len;
+	int sock;
+
+	if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		ERR("socket");
+	}
+	len = local_address(&name, path);
+	if(path[0] != '@' && unlink(path) < 0 && errno != ENOENT) {
+		ERR("unlink");
+	}
+	if(bind(sock, (struct sockaddr*) &name, len) < 0) {
+		ERR("bind");
+	}
+	if(path[0] != '@' && chmod(path, mode) < 0) {
+		ERR("chmod");
+	}
+	if(listen(sock, BACKLOG) < 0) {
+		ERR("listen");
+	}
+
+	return sock;
+}
+
+/*
+* Checks credentials of a client accepted on the unix socket, refused clients are disconnected.
+*
+* @args: acceptor arguments holding allowed users
+* @sock: accepted socket
+*
+* Returns 1 if the client may stay, 0 if it was disconnected.
+*/
+int local_peer_allowed(acc_clients_args* args, int sock) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int i;
+
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		if(args->local->uid_count == 0 && cred.uid == geteuid()) {
+			return 1;
+		}
+		for(i = 0; i < args->local->uid_count; ++i) {
+			if(args->local->uids[i] == cred.uid) {
+				return 1;
+			}
+		}
+		fprintf(stderr, "Refused local client pid %d uid %d.\n", (int) cred.pid, (int) cred.uid);
+	}
+	__atomic_fetch_add(&args->metrics->rejected_peers, 1, __ATOMIC_RELAXED);
+	if(TEMP_FAILURE_RETRY(close(sock)) < 0) {
+		ERR("close");
+	}
+	return 0;
+}
+
+/*
+* Checks that a peer accepted on a control socket runs as the user of the server, others are disconnected.
+*
+* @sock: accepted socket
+* @what: name of the socket for the log
+*
+* Returns 1 if the peer may stay, 0 if it was disconnected.
+*/
+int local_peer_owned(int sock, char* what) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		if(cred.uid == geteuid()) {
+			return 1;
+		}
+		fprintf(stderr, "Refused %s peer pid %d uid %d.\n", what, (int) cred.pid, (int) cred.uid);
+	}
+	if(TEMP_FAILURE_RETRY(close(sock)) < 0) {
+		ERR("close");
+	}
+	return 0;
+}
+
+/*
+* Moves the horse by one race turn, tiring it.
+*/
+void horse_step(horse* data) {
+	float distance;
+
+	distance = data->rest_factor * MAX_HORSE_SPEED + (rand() % 5);
+	data->distance_run += distance;
+	data->rest_factor -= distance * 0.001;
+}
+
+void run_race(horse* data, horse_args* args) {
+	long begin;
+	while(data->running && !(*args->winner) && !exit_flag) {
+		horse_step(data);
+
+		if(data->running && !(*args->winner)) {
+			fprintf(stderr, "Horse: %s\tDistance run: %d, Rest Factor: %f\n", data->name, data->distance_run, data->rest_factor);
+		}
+		
+		if(data->distance_run >= RACE_DISTANCE) {
+			data->running = 0;
+			begin = trace_begin();
+			if(pthread_mutex_lock(data->mutex) != 0) {
+				ERR("pthread_mutex_lock");
+			}
+			trace_end("lock race_mutex", begin);
+			if(!(*args->winner)) {
+				*args->winner = data;
+				fprintf(stderr, "Horse: %s won!\n", data->name);
+			}
+			
+			fprintf(stderr, "Horse: %s waiting on cond...\n", data->name);
+			begin = trace_begin();
+			if(pthread_cond_wait(data->cond, data->mutex) != 0) {
+				ERR("pthread_cond_wait");
+			}
+			if(pthread_mutex_unlock(data->mutex) != 0) {
+				ERR("pthread_mutex_unlock");
+			}
+			sched_record_tick(args->metrics, ROLE_RACE);
+			trace_end("wait turn", begin);
+		
+			fprintf(stderr, "Horse: %s waiting on barrier...\n", data->name);
+			begin = trace_begin();
+			pthread_barrier_wait(data->barrier);
+			trace_end("barrier", begin);
+
+			data->distance_run = 0;
+			break;
+		}
+		begin = trace_begin();
+		if(pthread_mutex_lock(data->mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		trace_end("lock race_mutex", begin);
+			fprintf(stderr, "Horse: %s waiting on cond...\n", data->name);
+		begin = trace_begin();
+		if(pthread_cond_wait(data->cond, data->mutex) != 0) {
+			ERR("pthread_cond_wait");
+		}
+		if(pthread_mutex_unlock(data->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		sched_record_tick(args->metrics, ROLE_RACE);
+		trace_end("wait turn", begin);
+		
+		fprintf(stderr, "Horse: %s waiting on barrier...\n", data->name);
+		begin = trace_begin();
+		pthread_barrier_wait(data->barrier);
+		trace_end("barrier", begin);
+	}
+}
+
+void* horse_thread(void* arg) {
+	horse_args* args = (horse_args*) arg;
+	horse* data = args->horse_data;
+	time_t start, end, dif;
+	long begin, waited;
+	
+	while(!exit_flag) {
+		start = time(NULL);
+		begin = trace_begin();
+		waited = 0;
+		if(pthread_mutex_lock(data->mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		while(!data->running && !exit_flag) {
+			if(pthread_cond_wait(data->cond, data->mutex) != 0) {
+				ERR("pthread_cond_wait");
+			}
+			fprintf(stderr, "horse: %s awaken!, running: %d\n", data->name, data->running);
+			sched_record_tick(args->metrics, ROLE_RACE);
+			waited = begin;
+		}
+		if(pthread_mutex_unlock(data->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		/* Horses are spawned before tracing is configured, they join the trace once running */
+		trace_thread(data->name);
+		trace_end("wait race", waited);
+		
+		end = time(NULL);
+		
+		dif = end - start;
+
+		data->rest_factor += dif * 0.05;
+		data->rest_factor = (data->rest_factor >= 1) ? 1 : data->rest_factor;
+	
+		run_race(data, args);
+	}
+	pthread_exit(NULL);
+}
+
+/*
+* Allocates state of a freshly accepted session.
+*
+* @args: acceptor arguments holding shared server state
+* @sock: socket of the accepted connection
+*
+* Returns the new session.
+*/
+player_th_data* new_session(acc_clients_args* args, int sock) {
+	player_th_data* thread_data;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	double now;
+
+	thread_data = (player_th_data*) pool_alloc(POOL_SESSIONS);
+	thread_data->socket = sock;
+	thread_data->index = -1;
+	thread_data->loop = NULL;
+	thread_data->holding = 0;
+	thread_data->held = NULL;
+	thread_data->held_len = thread_data->held_capacity = 0;
+	thread_data->players = args->players;
+	thread_data->state_mutex = args->state_mutex;
+	thread_data->state_cond = args->state_cond;
+	thread_data->cond = args->cond;
+	thread_data->mutex = args->mutex;
+	thread_data->bank_mutex = args->bank_mutex;
+	thread_data->state = args->state;
+	thread_data->horse_count = args->horse_count;
+	thread_data->horses = args->horses;
+	thread_data->curr_running_horses = args->curr_running_horses;
+	thread_data->winner = args->winner;
+	thread_data->bank = args->bank;
+	thread_data->time = args->time;
+	thread_data->interval = args->interval;
+	thread_data->book = args->book;
+	thread_data->tmpl = args->tmpl;
+	thread_data->snapshots = args->snapshots;
+	thread_data->limiter = args->limiter;
+	thread_data->metrics = args->metrics;
+	thread_data->handoff = args->handoff;
+	thread_data->export = args->export;
+	thread_data->replica = args->replica;
+	thread_data->ticks = args->ticks;
+	thread_data->io_role = args->io_role;
+	if(getpeername(sock, (struct sockaddr*) &addr, &addr_len) == 0) {
+		if(addr.sin_family == AF_INET) {
+			thread_data->peer = addr.sin_addr.s_addr;
+		}
+		/* Unix peers were admitted by their credentials */
+		thread_data->local = (addr.sin_family == AF_UNIX);
+	}
+	now = monotonic_now();
+	bucket_init(&thread_data->cmd_bucket, &args->limiter->cmd, now);
+	bucket_init(&thread_data->bet_bucket, &args->limiter->bet, now);
+	handoff_add_session(args->handoff, thread_data);
+
+	return thread_data;
+}
+
+void* server_accept_connections(void* arg) {
+	acc_clients_args* args = (acc_clients_args*) arg;
+	handoff_state* h = args->handoff;
+	int sock, i, nfds, listen_count = 1;
+	struct pollfd fds[3];
+	eventfd_t wakeups;
+	pthread_t id;
+	pthread_attr_t thattr;
+	player_th_data* thread_data;
+
+	single_pthread_sigmask(SIG_UNBLOCK, SIGUSR1);
+	
+	if(pthread_attr_init(&thattr) != 0) {
+		ERR("pthread_attr_init");
+	}
+	if(pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED) != 0) {
+		ERR("pthread_attr_setdetachstate");
+	}
+	trace_thread("acceptor");
+
+	fds[0].fd = h->wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = args->socket;
+	fds[1].events = POLLIN;
+	if(args->local_socket >= 0) {
+		fds[2].fd = args->local_socket;
+		fds[2].events = POLLIN;
+		listen_count = 2;
+	}
+	while(!exit_flag) {
+		fprintf(stderr, "Waiting for connection...\n");
+		/* Listeners leave the poll set while a handoff passes them on, clients queue in their backlog */
+		nfds = __atomic_load_n(&h->accept_paused, __ATOMIC_ACQUIRE) ? 1 : 1 + listen_count;
+		if(poll(fds, nfds, -1) < 0) {
+			if(errno == EINTR) continue;
+			ERR("poll");
+		}
+		if((fds[0].revents & POLLIN) && eventfd_read(h->wake_fd, &wakeups) < 0) {
+			ERR("eventfd_read");
+		}
+		for(i = 1; i < nfds && !exit_flag; ++i) {
+			if(!(fds[i].revents & POLLIN)) {
+				continue;
+			}
+			/* Shared ledger lock: a handoff sends the session list only after the session is on it */
+			if(pthread_rwlock_rdlock(&h->ledger_lock) != 0) {
+				ERR("pthread_rwlock_rdlock");
+			}
+			if(__atomic_load_n(&h->accept_paused, __ATOMIC_ACQUIRE)) {
+				if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+					ERR("pthread_rwlock_unlock");
+				}
+				break;
+			}
+			if( (sock = accept(fds[i].fd, NULL, NULL)) < 0) {
+				if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+					ERR("pthread_rwlock_unlock");
+				}
+				if(errno == EINTR) continue;
+				ERR("accept");
+			}
+			if(fds[i].fd == args->local_socket && !local_peer_allowed(args, sock)) {
+				if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+					ERR("pthread_rwlock_unlock");
+				}
+				continue;
+			}
+			fprintf(stderr, "Accepted socket %d.\n", sock);
+			thread_data = new_session(args, sock);
+			if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+				ERR("pthread_rwlock_unlock");
+			}
+			if(pthread_create(&id, &thattr, handle_connection, (void*) thread_data) != 0) {
+				ERR("pthread_create");
+			}
+		}
+	}
+
+	if(pthread_attr_destroy(&thattr) != 0) {
+		ERR("pthread_attr_destroy");
+	}
+
+	pthread_exit(NULL);
+}
+
+int uring_setup(unsigned entries, struct io_uring_params* params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+* Submits prepared entries and optionally waits for completions.
+*
+* @loop: io_uring loop
+* @wait: number of completions to wait for
+*
+* Returns 0 on success, -1 on error (errno set).
+*/
+int uring_submit(uring_loop* loop, unsigned wait) {
+	int ret;
+
+	while(loop->to_submit > 0 || wait > 0) {
+		ret = uring_enter(loop->fd, loop->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if(ret < 0) {
+			if(errno == EINTR && !exit_flag && loop->to_submit == 0) continue;
+			return -1;
+		}
+		loop->to_submit -= ret;
+		if(wait) break;
+	}
+	return 0;
+}
+
+/*
+* Returns next free submission queue entry, submitting pending ones when the ring is full.
+*/
+struct io_uring_sqe* uring_get_sqe(uring_loop* loop) {
+	unsigned tail = *loop->sq_tail, index;
+	struct io_uring_sqe* sqe;
+
+	while(tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries) {
+		if(uring_submit(loop, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			ERR("io_uring_enter");
+		}
+	}
+	index = tail & loop->sq_mask;
+	sqe = &loop->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	loop->sq_array[index] = index;
+	__atomic_store_n(loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++loop->to_submit;
+	return sqe;
+}
+
+/*
+* Returns buffer to the ring of buffers provided for multishot recv.
+*/
+void uring_recycle_buf(uring_loop* loop, unsigned short bid) {
+	struct io_uring_buf* buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (loop->bufs + bid * BUF_SIZE);
+	buf->len = BUF_SIZE;
+	buf->bid = bid;
+	++loop->buf_tail;
+	__atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+* Arms multishot accept on one of the listening sockets, the socket rides in user_data above the tag.
+*/
+void uring_arm_accept(uring_loop* loop, int fd) {
+	struct io_uring_sqe* sqe = uring_get_sqe(loop);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uint64_t) fd << 3 | URING_TAG_ACCEPT;
+}
+
+void uring_arm_recv(uring_loop* loop, int fd, uint64_t user_data) {
+	struct io_uring_sqe* sqe = uring_get_sqe(loop);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = user_data;
+}
+
+void uring_arm_tick(uring_loop* loop) {
+	struct io_uring_sqe* sqe = uring_get_sqe(loop);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop->tick_fd;
+	sqe->addr = (uint64_t) (uintptr_t) &loop->tick_val;
+	sqe->len = sizeof(loop->tick_val);
+	sqe->user_data = URING_TAG_TICK;
+}
+
+void uring_arm_ack(uring_loop* loop) {
+	struct io_uring_sqe* sqe = uring_get_sqe(loop);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop->ack_fd;
+	sqe->addr = (uint64_t) (uintptr_t) &loop->ack_val;
+	sqe->len = sizeof(loop->ack_val);
+	sqe->user_data = URING_TAG_ACK;
+}
+
+/*
+* Arms a timeout at the deadline of the oldest parked session, unless one is armed already.
+*/
+void uring_arm_park(uring_loop* loop) {
+	struct io_uring_sqe* sqe;
+
+	if(!loop->parked || loop->park_armed) {
+		return;
+	}
+	loop->park_ts.tv_sec = loop->parked->ack_deadline / NSEC_PER_SEC;
+	loop->park_ts.tv_nsec = loop->parked->ack_deadline % NSEC_PER_SEC;
+	sqe = uring_get_sqe(loop);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) (uintptr_t) &loop->park_ts;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	sqe->user_data = URING_TAG_PARK;
+	loop->park_armed = 1;
+}
+
+/*
+* Checks that the kernel delivers multishot recv completions from provided buffers.
+* Kernels lacking the feature fail the request or terminate it after the first completion.
+*
+* Returns 0 if supported, -1 otherwise.
+*/
+int uring_probe_recv(uring_loop* loop) {
+	int sv[2], supported = 0, done = 0;
+	unsigned head;
+	struct io_uring_cqe* cqe;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		ERR("socketpair");
+	}
+	uring_arm_recv(loop, sv[0], URING_TAG_PROBE);
+	if(bulk_write(sv[1], "p", 1) < 0) {
+		ERR("write");
+	}
+	if(TEMP_FAILURE_RETRY(close(sv[1])) < 0) {
+		ERR("close");
+	}
+	while(!done) {
+		if(uring_submit(loop, 1) < 0) {
+			break;
+		}
+		head = *loop->cq_head;
+		while(head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &loop->cqes[head & loop->cq_mask];
+			if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE)) {
+				supported = 1;
+			}
+			if(cqe->flags & IORING_CQE_F_BUFFER) {
+				uring_recycle_buf(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+			if(!(cqe->flags & IORING_CQE_F_MORE)) {
+				done = 1;
+			}
+			++head;
+		}
+		__atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+	}
+	if(TEMP_FAILURE_RETRY(close(sv[0])) < 0) {
+		ERR("close");
+	}
+	return supported ? 0 : -1;
+}
+
+void uring_destroy(uring_loop* loop) {
+	player_th_data* session, *next;
+	replica_state* r = loop->args->replica;
+
+	if(loop->ack_fd >= 0) {
+		/* Sender thread outlives the loop, it stops signaling before the eventfd goes away */
+		if(pthread_mutex_lock(&r->mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		r->notify_fd = -1;
+		if(pthread_mutex_unlock(&r->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		if(TEMP_FAILURE_RETRY(close(loop->ack_fd)) < 0) {
+			ERR("close");
+		}
+	}
+
+	for(session = loop->sessions; session; session = next) {
+		next = session->next;
+		if(TEMP_FAILURE_RETRY(close(session->socket)) < 0) {
+			ERR("close");
+		}
+		pool_free(POOL_SESSIONS, session);
+	}
+	if(loop->bufs) {
+		free(loop->bufs);
+	}
+	if(loop->buf_ring) {
+		munmap(loop->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+	}
+	if(loop->ring) {
+		munmap(loop->ring, loop->ring_size);
+	}
+	if(loop->sqes) {
+		munmap(loop->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+	}
+	if(loop->fd >= 0 && TEMP_FAILURE_RETRY(close(loop->fd)) < 0) {
+		ERR("close");
+	}
+}
+
+/*
+* Creates io_uring instance used by the session layer.
+* Fails without side effects when the kernel lacks io_uring, a single mmap ring,
+* provided buffer rings or multishot recv, so that the caller can fall back to threads.
+*
+* @loop:    loop to be initialized
+* @args:    acceptor arguments holding the listening socket and shared server state
+* @tick_fd: eventfd signaled on every race turn
+*
+* Returns 0 on success, -1 when io_uring is not usable.
+*/
+int uring_init(uring_loop* loop, acc_clients_args* args, int tick_fd) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sq_size, cq_size;
+	int i;
+	char* ring;
+
+	memset(loop, 0, sizeof(uring_loop));
+	memset(&params, 0, sizeof(params));
+	loop->args = args;
+	loop->tick_fd = tick_fd;
+	loop->ack_fd = -1;
+
+	if( (loop->fd = uring_setup(URING_ENTRIES, &params)) < 0) {
+		return -1;
+	}
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		goto failed;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	loop->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+	if( (ring = mmap(NULL, loop->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		goto failed;
+	}
+	loop->ring = ring;
+	if( (loop->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		loop->sqes = NULL;
+		goto failed;
+	}
+
+	loop->sq_head = (unsigned*) (ring + params.sq_off.head);
+	loop->sq_tail = (unsigned*) (ring + params.sq_off.tail);
+	loop->sq_mask = *(unsigned*) (ring + params.sq_off.ring_mask);
+	loop->sq_entries = *(unsigned*) (ring + params.sq_off.ring_entries);
+	loop->sq_array = (unsigned*) (ring + params.sq_off.array);
+	loop->cq_head = (unsigned*) (ring + params.cq_off.head);
+	loop->cq_tail = (unsigned*) (ring + params.cq_off.tail);
+	loop->cq_mask = *(unsigned*) (ring + params.cq_off.ring_mask);
+	loop->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+
+	if( (loop->buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		loop->buf_ring = NULL;
+		goto failed;
+	}
+	if( (loop->bufs = (char*) malloc(URING_BUF_COUNT * BUF_SIZE)) == NULL) {
+		ERR("malloc");
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) loop->buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if(uring_register(loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		goto failed;
+	}
+	for(i = 0; i < URING_BUF_COUNT; ++i) {
+		uring_recycle_buf(loop, i);
+	}
+
+	if(uring_probe_recv(loop) < 0) {
+		errno = ENOSYS;
+		goto failed;
+	}
+	if( (loop->ack_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		goto failed;
+	}
+	/* Loop is created before the standby can connect, no acknowledgement is missed */
+	args->replica->notify_fd = loop->ack_fd;
+	return 0;
+
+failed:
+	i = errno;
+	uring_destroy(loop);
+	errno = i;
+	return -1;
+}
+
+uring_msg* uring_msg_ref(uring_msg* msg) {
+	++msg->refs;
+	return msg;
+}
+
+void uring_msg_unref(uring_msg* msg) {
+	if(--msg->refs <= 0) {
+		free(msg);
+	}
+}
+
+/*
+* Puts the session on the list of sessions whose queued sends should be submitted.
+*/
+void uring_schedule_flush(player_th_data* session) {
+	if(session->flush_pending) {
+		return;
+	}
+	session->flush_pending = 1;
+	session->next_flush = session->loop->flush;
+	session->loop->flush = session;
+}
+
+/*
+* Queues message for sending on the session. Message is freed once every send referencing it completes.
+*/
+void uring_queue_msg(player_th_data* session, uring_msg* msg) {
+	uring_send* send;
+
+	if(session->closing) {
+		if(msg->refs == 0) {
+			free(msg);
+		}
+		return;
+	}
+	send = (uring_send*) pool_alloc(POOL_SENDS);
+	send->msg = uring_msg_ref(msg);
+	send->session = session;
+	send->next = NULL;
+	if(session->out_tail) {
+		session->out_tail->next = send;
+	} else {
+		session->out_head = send;
+	}
+	session->out_tail = send;
+	if(session->sends_in_flight == 0) {
+		uring_schedule_flush(session);
+	}
+}
+
+/*
+* Submits all sends queued on the session as one linked chain,
+* so that the kernel keeps their order on the socket.
+*/
+void uring_flush_session(player_th_data* session) {
+	uring_send* send, *next;
+	struct io_uring_sqe* sqe;
+
+	for(send = session->out_head; send; send = next) {
+		next = send->next;
+		sqe = uring_get_sqe(session->loop);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = session->socket;
+		sqe->addr = (uint64_t) (uintptr_t) send->msg->data;
+		sqe->len = send->msg->len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->flags = next ? IOSQE_IO_LINK : 0;
+		sqe->user_data = (uint64_t) (uintptr_t) send | URING_TAG_SEND;
+		++session->sends_in_flight;
+	}
+	session->out_head = session->out_tail = NULL;
+}
+
+void uring_flush(uring_loop* loop) {
+	player_th_data* session;
+
+	while( (session = loop->flush) ) {
+		loop->flush = session->next_flush;
+		session->flush_pending = 0;
+		/* Parked sessions are scheduled again when the standby acknowledges their bet */
+		if(session->sends_in_flight == 0 && !session->parked) {
+			uring_flush_session(session);
+		}
+	}
+}
+
+/*
+* Sends the same message to every logged in session of the loop.
+* Message is rendered once and referenced by all queued sends.
+*/
+void uring_broadcast(uring_loop* loop, char* buf, size_t count) {
+	uring_msg* msg;
+	player_th_data* session;
+
+	if( (msg = (uring_msg*) malloc(sizeof(uring_msg) + count)) == NULL) {
+		ERR("malloc");
+	}
+	msg->refs = 1;
+	msg->len = count;
+	memcpy(msg->data, buf, count);
+	for(session = loop->sessions; session; session = session->next) {
+		if(session->index >= 0 && !session->closing) {
+			uring_queue_msg(session, msg);
+		}
+	}
+	uring_msg_unref(msg);
+}
+
+/*
+* Takes the session off the list of parked sessions.
+*/
+void uring_unpark(player_th_data* session) {
+	player_th_data** p;
+
+	for(p = &session->loop->parked; *p != session; p = &(*p)->next_parked);
+	*p = session->next_parked;
+	session->next_parked = NULL;
+	session->parked = 0;
+}
+
+/*
+* Holds replies of the session until the standby acknowledges the bet it just placed.
+* Bets of the session placed meanwhile move it to the end of the list with a new deadline.
+*/
+void uring_park_session(uring_loop* loop, player_th_data* session) {
+	replica_state* r = loop->args->replica;
+	player_th_data** p;
+
+	if(session->parked) {
+		uring_unpark(session);
+	}
+	if(session->ack_seq == 0 || r->ack_ms <= 0) {
+		return;
+	}
+	session->ack_deadline = monotonic_ns() + r->ack_ms * (NSEC_PER_SEC / 1000);
+	session->parked = 1;
+	for(p = &loop->parked; *p; p = &(*p)->next_parked);
+	*p = session;
+	uring_arm_park(loop);
+}
+
+/*
+* Sends replies of parked sessions whose bet was acknowledged, whose standby went away or whose deadline passed.
+*
+* @all: releases every parked session (the loop is about to stop for a handoff)
+*/
+void uring_check_parked(uring_loop* loop, int all) {
+	replica_state* r = loop->args->replica;
+	player_th_data* session, *next;
+	uint64_t acked;
+	long now;
+	int gone, acknowledged;
+
+	if(!loop->parked) {
+		return;
+	}
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	acked = r->acked;
+	gone = (r->fd < 0);
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	now = monotonic_ns();
+	for(session = loop->parked; session; session = next) {
+		next = session->next_parked;
+		acknowledged = (acked >= session->ack_seq);
+		if(!all && !gone && !acknowledged && now < session->ack_deadline) {
+			continue;
+		}
+		replica_ack_waited(loop->args->metrics, now - session->ack_deadline + r->ack_ms * (NSEC_PER_SEC / 1000),
+			!gone && !acknowledged && now >= session->ack_deadline);
+		uring_unpark(session);
+		if(session->out_head && session->sends_in_flight == 0) {
+			uring_schedule_flush(session);
+		}
+	}
+	uring_arm_park(loop);
+}
+
+/*
+* Frees the session once no request of the loop references it.
+*/
+void uring_release_session(player_th_data* session) {
+	uring_send* send, *next;
+	uring_loop* loop = session->loop;
+
+	if(!session->closing || session->recv_armed || session->sends_in_flight || session->flush_pending) {
+		return;
+	}
+	for(send = session->out_head; send; send = next) {
+		next = send->next;
+		uring_msg_unref(send->msg);
+		pool_free(POOL_SENDS, send);
+	}
+	if(session->prev) {
+		session->prev->next = session->next;
+	} else {
+		loop->sessions = session->next;
+	}
+	if(session->next) {
+		session->next->prev = session->prev;
+	}
+	if(TEMP_FAILURE_RETRY(close(session->socket)) < 0) {
+		ERR("close");
+	}
+	fprintf(stderr, "Connection ended.\n");
+	pool_free(POOL_SESSIONS, session);
+}
+
+void uring_close_session(player_th_data* session) {
+	if(session->parked) {
+		uring_unpark(session);
+	}
+	if(!session->closing) {
+		session->closing = 1;
+		handoff_remove_session(session->handoff, session);
+		shutdown(session->socket, SHUT_RDWR);
+	}
+	uring_release_session(session);
+}
+
+/*
+* Starts serving the session from the loop.
+*/
+void uring_add_session(uring_loop* loop, player_th_data* session) {
+	session->loop = loop;
+	session->next = loop->sessions;
+	if(loop->sessions) {
+		loop->sessions->prev = session;
+	}
+	loop->sessions = session;
+	session->recv_armed = 1;
+	uring_arm_recv(loop, session->socket, (uint64_t) (uintptr_t) session | URING_TAG_RECV);
+}
+
+void uring_handle_accept(uring_loop* loop, struct io_uring_cqe* cqe) {
+	player_th_data* session;
+	int fd = cqe->user_data >> 3;
+
+	if(!(cqe->flags & IORING_CQE_F_MORE) && !exit_flag) {
+		uring_arm_accept(loop, fd);
+	}
+	if(cqe->res < 0) {
+		if(cqe->res != -ECANCELED) {
+			fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+		}
+		return;
+	}
+	if(fd == loop->args->local_socket && !local_peer_allowed(loop->args, cqe->res)) {
+		return;
+	}
+	fprintf(stderr, "Accepted socket %d.\n", cqe->res);
+	session = new_session(loop->args, cqe->res);
+	uring_add_session(loop, session);
+	session_write(session, ENTER_LOGIN_MSG, strlen(ENTER_LOGIN_MSG));
+}
+
+void uring_handle_recv(uring_loop* loop, player_th_data* session, struct io_uring_cqe* cqe) {
+	char buf[BUF_SIZE + 1];
+	uint64_t seq;
+	unsigned short bid;
+	int len = cqe->res;
+
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(len > 0) {
+			memcpy(buf, loop->bufs + bid * BUF_SIZE, len);
+		}
+		uring_recycle_buf(loop, bid);
+	}
+	if(!(cqe->flags & IORING_CQE_F_MORE)) {
+		session->recv_armed = 0;
+	}
+
+	/* Requests cancelled by an abandoned handoff are simply armed again */
+	if(len <= 0 && len != -ENOBUFS && len != -ECANCELED) {
+		if(len == 0) {
+			fprintf(stderr, "Connection closed.\n");
+		}
+		uring_close_session(session);
+		return;
+	}
+
+	if(len > 0 && !session->closing) {
+		buf[len] = '\0';
+		if(session->index < 0) {
+			if(session_login(session, buf, len) == 0 && session->index < 0) {
+				uring_close_session(session);
+				return;
+			}
+		} else {
+			seq = session->ack_seq;
+			route_cmd(session, buf);
+			if(session->ack_seq != seq) {
+				uring_park_session(loop, session);
+			}
+		}
+	}
+
+	if(!session->recv_armed && !session->closing) {
+		session->recv_armed = 1;
+		uring_arm_recv(loop, session->socket, (uint64_t) (uintptr_t) session | URING_TAG_RECV);
+	}
+	uring_release_session(session);
+}
+
+void uring_handle_send(uring_send* send, struct io_uring_cqe* cqe) {
+	player_th_data* session = send->session;
+
+	uring_msg_unref(send->msg);
+	pool_free(POOL_SENDS, send);
+	--session->sends_in_flight;
+	if(cqe->res < 0 && cqe->res != -ECANCELED) {
+		uring_close_session(session);
+	} else if(session->sends_in_flight == 0 && session->out_head) {
+		uring_schedule_flush(session);
+	}
+	uring_release_session(session);
+}
+
+void uring_handle_tick(uring_loop* loop, struct io_uring_cqe* cqe) {
+	char race_status[LINE_BUF * MAX_HORSES_PER_RACE];
+	size_t len;
+	long begin = trace_begin();
+
+	if(cqe->res < 0 && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+		ERR("read");
+	}
+	sched_record_tick(loop->args->metrics, ROLE_IO);
+	/* Handoff wakes the loop through the tick eventfd, replies held for the standby go out before it stops */
+	if(__atomic_load_n(&loop->args->handoff->pending, __ATOMIC_RELAXED)) {
+		uring_check_parked(loop, 1);
+	}
+	if(*loop->args->state != STATE_NOT_RACING) {
+		len = render_race_status(race_status, LINE_BUF * MAX_HORSES_PER_RACE, loop->args->tmpl, *loop->args->winner);
+		uring_broadcast(loop, race_status, len);
+	}
+	uring_arm_tick(loop);
+	trace_end("tick fanout", begin);
+}
+
+void uring_handle_ack(uring_loop* loop, struct io_uring_cqe* cqe) {
+	if(cqe->res < 0 && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+		ERR("read");
+	}
+	uring_check_parked(loop, 0);
+	uring_arm_ack(loop);
+}
+
+void uring_handle_park(uring_loop* loop) {
+	loop->park_armed = 0;
+	uring_check_parked(loop, 0);
+}
+
+/*
+* Serves all sessions with a single thread driving io_uring.
+* New connections come from multishot accept, commands from multishot recv into provided buffers,
+* race turns are fanned out as linked sends submitted together with one io_uring_enter.
+*/
+void* server_uring_loop(void* arg) {
+	uring_loop* loop = (uring_loop*) arg;
+	struct io_uring_cqe* cqe;
+	unsigned head;
+	uint64_t user_data;
+
+	single_pthread_sigmask(SIG_UNBLOCK, SIGUSR1);
+	trace_thread("uring");
+
+	uring_arm_accept(loop, loop->args->socket);
+	if(loop->args->local_socket >= 0) {
+		uring_arm_accept(loop, loop->args->local_socket);
+	}
+	uring_arm_tick(loop);
+	uring_arm_ack(loop);
+
+	while(!exit_flag) {
+		/* Handoff to the next build stops the loop here, it wakes the loop through the tick eventfd */
+		ledger_lock(loop->args->handoff);
+		uring_flush(loop);
+		if(uring_submit(loop, 1) < 0 && errno != EINTR) {
+			ERR("io_uring_enter");
+		}
+		head = *loop->cq_head;
+		while(head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &loop->cqes[head & loop->cq_mask];
+			user_data = cqe->user_data;
+			switch(user_data & URING_TAG_MASK) {
+				case URING_TAG_ACCEPT:
+					uring_handle_accept(loop, cqe);
+					break;
+				case URING_TAG_RECV:
+					uring_handle_recv(loop, (player_th_data*) (uintptr_t) (user_data & ~(uint64_t) URING_TAG_MASK), cqe);
+					break;
+				case URING_TAG_SEND:
+					uring_handle_send((uring_send*) (uintptr_t) (user_data & ~(uint64_t) URING_TAG_MASK), cqe);
+					break;
+				case URING_TAG_TICK:
+					uring_handle_tick(loop, cqe);
+					break;
+				case URING_TAG_ACK:
+					uring_handle_ack(loop, cqe);
+					break;
+				case URING_TAG_PARK:
+					uring_handle_park(loop);
+					break;
+			}
+			++head;
+			__atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+		}
+		ledger_unlock(loop->args->handoff);
+	}
+
+	uring_destroy(loop);
+	pool_thread_flush();
+	pthread_exit(NULL);
+}
+
+void handoff_init(handoff_state* h, char* path) {
+	pthread_rwlockattr_t attr;
+
+	memset(h, 0, sizeof(handoff_state));
+	h->listen_fd = -1;
+	strncpy(h->path, path, HANDOFF_PATH_LEN - 1);
+	if( (h->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		ERR("eventfd");
+	}
+	if(pthread_rwlockattr_init(&attr) != 0) {
+		ERR("pthread_rwlockattr_init");
+	}
+	/* Sessions keep taking the lock shared, a waiting handoff must not starve */
+	if(pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) != 0) {
+		ERR("pthread_rwlockattr_setkind_np");
+	}
+	if(pthread_rwlock_init(&h->ledger_lock, &attr) != 0) {
+		ERR("pthread_rwlock_init");
+	}
+	if(pthread_rwlockattr_destroy(&attr) != 0) {
+		ERR("pthread_rwlockattr_destroy");
+	}
+	if(pthread_mutex_init(&h->mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
+	}
+}
+
+void handoff_destroy(handoff_state* h) {
+	if(h->listen_fd >= 0) {
+		if(TEMP_FAILURE_RETRY(close(h->listen_fd)) < 0) {
+			ERR("close");
+		}
+		if(h->path[0] != '@') {
+			unlink(h->path);
+		}
+	}
+	if(TEMP_FAILURE_RETRY(close(h->wake_fd)) < 0) {
+		ERR("close");
+	}
+	if(pthread_rwlock_destroy(&h->ledger_lock) != 0) {
+		ERR("pthread_rwlock_destroy");
+	}
+	if(pthread_mutex_destroy(&h->mutex) != 0) {
+		ERR("pthread_mutex_destroy");
+	}
+	free(h->adopted);
+}
+
+/*
+* Sends one descriptor with SCM_RIGHTS.
+*
+* @sock:  unix socket connected to the next build
+* @fd:    descriptor to pass
+* @index: player logged in on the descriptor (-1 if none)
+*
+* Returns 0 on success, -1 on error.
+*/
+int handoff_send_fd(int sock, int fd, int32_t index) {
+	struct msghdr msg;
+	struct iovec iov = {&index, sizeof(index)};
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr* cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return (TEMP_FAILURE_RETRY(sendmsg(sock, &msg, MSG_NOSIGNAL)) == sizeof(index)) ? 0 : -1;
+}
+
+/*
+* Receives one descriptor sent by handoff_send_fd.
+*
+* Returns the descriptor, -1 on error.
+*/
+int handoff_recv_fd(int sock, int32_t* index) {
+	struct msghdr msg;
+	struct iovec iov = {index, sizeof(*index)};
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr* cmsg;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(TEMP_FAILURE_RETRY(recvmsg(sock, &msg, 0)) != sizeof(*index)) {
+		return -1;
+	}
+	if( (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/*
+* Sends columns of the bet book, settlement scratch columns are not sent.
+*/
+int handoff_send_book(int conn, bet_book* book) {
+	int i;
+
+	if(bulk_write(conn, (char*) book->player, book->count * sizeof(int32_t)) < 0 ||
+		bulk_write(conn, (char*) book->type, book->count * sizeof(uint8_t)) < 0 ||
+		bulk_write(conn, (char*) book->stake, book->count * sizeof(int32_t)) < 0) {
+		return -1;
+	}
+	for(i = 0; i < BET_PLACES; ++i) {
+		if(bulk_write(conn, (char*) book->sel[i], book->count * sizeof(int16_t)) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+* Sends ledger, upcoming race, listening socket and client sockets to the next build.
+* Runs between races with commands frozen and the sessions list locked.
+*
+* @h:    handoff state of the process
+* @conn: unix socket connected to the next build
+*
+* Returns 0 when the next build confirmed the takeover, -1 otherwise.
+*/
+int handoff_send(handoff_state* h, int conn) {
+	acc_clients_args* args = h->args;
+	handoff_header hdr;
+	handoff_player pl;
+	player_th_data* session;
+	player* p;
+	float rest;
+	char ack;
+	int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HANDOFF_MAGIC;
+	hdr.bank = *args->bank;
+	hdr.horse_count = args->horse_count;
+	hdr.winner = (*args->winner) ? *args->winner - args->horses : -1;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		hdr.field[i] = ((*args->curr_running_horses)[i]) ? (*args->curr_running_horses)[i] - args->horses : -1;
+	}
+	hdr.next_start = *args->time + *args->interval;
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if(args->players[i]) {
+			++hdr.player_count;
+		}
+	}
+	for(session = h->sessions; session; session = session->all_next) {
+		++hdr.session_count;
+	}
+	hdr.local_listener = (args->local_socket >= 0);
+	hdr.replica_listener = (args->replica->listen_fd >= 0);
+	hdr.ticket_count = args->book->count;
+	memcpy(hdr.pools, args->book->pool, sizeof(hdr.pools));
+	if(bulk_write(conn, (char*) &hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if( (p = args->players[i]) == NULL) {
+			continue;
+		}
+		memset(&pl, 0, sizeof(pl));
+		pl.index = i;
+		pl.money = p->money;
+		pl.horse_bet = (p->horse_bet) ? p->horse_bet - args->horses : -1;
+		pl.money_bet = p->money_bet;
+		memcpy(pl.name, p->name, MAX_NAME_LEN);
+		pl.token = p->token;
+		if(bulk_write(conn, (char*) &pl, sizeof(pl)) < 0) {
+			return -1;
+		}
+	}
+	for(i = 0; i < args->horse_count; ++i) {
+		rest = args->horses[i].rest_factor;
+		if(bulk_write(conn, (char*) &rest, sizeof(rest)) < 0) {
+			return -1;
+		}
+	}
+	if(handoff_send_book(conn, args->book) < 0) {
+		return -1;
+	}
+
+	if(handoff_send_fd(conn, args->socket, -1) < 0) {
+		return -1;
+	}
+	if(args->local_socket >= 0 && handoff_send_fd(conn, args->local_socket, -1) < 0) {
+		return -1;
+	}
+	if(args->replica->listen_fd >= 0) {
+		/* Next build keeps the replica socket, rebinding an abstract name would fail while this process lives */
+		replica_hand_over(args->replica, 1);
+		if(handoff_send_fd(conn, args->replica->listen_fd, -1) < 0) {
+			return -1;
+		}
+	}
+	for(session = h->sessions; session; session = session->all_next) {
+		if(handoff_send_fd(conn, session->socket, session->index) < 0) {
+			return -1;
+		}
+	}
+	/* Next build listens on the upgrade socket once it confirms, an abstract name must be free by then */
+	if(TEMP_FAILURE_RETRY(close(h->listen_fd)) < 0) {
+		ERR("close");
+	}
+	h->listen_fd = -1;
+	return (bulk_read(conn, &ack, 1) == 1) ? 0 : -1;
+}
+
+/*
+* Cancels every request of the io_uring loop so that the kernel stops reading client sockets.
+*/
+void handoff_cancel_uring(uring_loop* loop) {
+	struct io_uring_sync_cancel_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.flags = IORING_ASYNC_CANCEL_ANY;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	if(uring_register(loop->fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 && errno != ENOENT) {
+		perror("IORING_REGISTER_SYNC_CANCEL");
+	}
+}
+
+/*
+* Stops or resumes accepting clients on the threads backend while the listening sockets are being passed on.
+* Connections arriving in the meantime wait in the backlog of the passed socket.
+*
+* @paused: 1 stops accepting, 0 resumes after an abandoned handoff
+*/
+void handoff_pause_accept(handoff_state* h, short paused) {
+	__atomic_store_n(&h->accept_paused, paused, __ATOMIC_RELEASE);
+	if(eventfd_write(h->wake_fd, 1) < 0) {
+		ERR("eventfd_write");
+	}
+}
+
+/*
+* Waits for the next build and hands the server over to it at the end of the current race.
+* The process exits once the next build confirms, an abandoned handoff resumes service.
+*/
+void* handoff_listener(void* arg) {
+	handoff_state* h = (handoff_state*) arg;
+	acc_clients_args* args = h->args;
+	int conn;
+
+	single_pthread_sigmask(SIG_UNBLOCK, SIGUSR1);
+
+	while(!exit_flag) {
+		if( (conn = accept(h->listen_fd, NULL, NULL)) < 0) {
+			if(errno == EINTR) continue;
+			ERR("accept");
+		}
+		/* State and client sockets are handed over only to a build run by the same user */
+		if(!local_peer_owned(conn, "upgrade")) {
+			continue;
+		}
+		fprintf(stderr, "Upgrade requested, waiting for the race to end...\n");
+		if(pthread_mutex_lock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		h->pending = 1;
+		while(*args->state != STATE_NOT_RACING && !exit_flag) {
+			if(pthread_cond_wait(args->state_cond, args->state_mutex) != 0) {
+				ERR("pthread_cond_wait");
+			}
+		}
+		if(pthread_mutex_unlock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+
+		if(h->loop && eventfd_write(h->loop->tick_fd, 1) < 0) {
+			ERR("eventfd_write");
+		}
+		handoff_pause_accept(h, 1);
+		if(pthread_rwlock_wrlock(&h->ledger_lock) != 0) {
+			ERR("pthread_rwlock_wrlock");
+		}
+		if(h->loop) {
+			handoff_cancel_uring(h->loop);
+		}
+		if(pthread_mutex_lock(&h->mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		if(!exit_flag && handoff_send(h, conn) == 0) {
+			replica_end(args->replica);
+			fprintf(stderr, "Server handed over to the next build, exiting.\n");
+			fflush(NULL);
+			_exit(EXIT_SUCCESS);
+		}
+		fprintf(stderr, "Upgrade abandoned, resuming.\n");
+		replica_hand_over(args->replica, 0);
+		if(h->listen_fd < 0) {
+			h->listen_fd = make_local_socket(h->path, 0600);
+		}
+		if(pthread_mutex_unlock(&h->mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		if(pthread_rwlock_unlock(&h->ledger_lock) != 0) {
+			ERR("pthread_rwlock_unlock");
+		}
+		handoff_pause_accept(h, 0);
+		if(pthread_mutex_lock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		h->pending = 0;
+		if(pthread_cond_broadcast(args->state_cond) != 0) {
+			ERR("pthread_cond_broadcast");
+		}
+		if(pthread_mutex_unlock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		if(TEMP_FAILURE_RETRY(close(conn)) < 0) {
+			ERR("close");
+		}
+	}
+	pthread_exit(NULL);
+}
+
+/*
+* Starts accepting the next build on the upgrade socket.
+*/
+void handoff_listen(handoff_state* h, pthread_t* tid) {
+	/* Path may still be held by the process this one took over from, it is unlinked first */
+	h->listen_fd = make_local_socket(h->path, 0600);
+	if(pthread_create(tid, NULL, handoff_listener, (void*) h) != 0) {
+		ERR("pthread_create");
+	}
+}
+
+/*
+* Connects to a running server waiting for its replacement.
+*
+* Returns connected socket, -1 when no server listens on the path.
+*/
+int handoff_connect(char* path) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	int sock;
+
+	if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		ERR("socket");
+	}
+	len = local_address(&addr, path);
+	if(connect(sock, (struct sockaddr*) &addr, len) < 0) {
+		if(errno != ENOENT && errno != ECONNREFUSED) {
+			ERR("connect");
+		}
+		if(TEMP_FAILURE_RETRY(close(sock)) < 0) {
+			ERR("close");
+		}
+		return -1;
+	}
+	return sock;
+}
+
+/*
+* Reads columns of the bet book sent by handoff_send_book and checks tickets refer to known players and horses.
+*
+* Returns 0 on success, -1 otherwise.
+*/
+int handoff_receive_book(int conn, handoff_header* hdr, acc_clients_args* args) {
+	bet_book* book = args->book;
+	size_t count;
+	int i, j;
+
+	if(hdr->ticket_count < 0) {
+		return -1;
+	}
+	book_reserve(book, hdr->ticket_count);
+	count = hdr->ticket_count;
+	/* A failed read returns -1, which never equals a column length */
+	if((size_t) bulk_read(conn, (char*) book->player, count * sizeof(int32_t)) != count * sizeof(int32_t) ||
+		(size_t) bulk_read(conn, (char*) book->type, count * sizeof(uint8_t)) != count * sizeof(uint8_t) ||
+		(size_t) bulk_read(conn, (char*) book->stake, count * sizeof(int32_t)) != count * sizeof(int32_t)) {
+		return -1;
+	}
+	for(i = 0; i < BET_PLACES; ++i) {
+		if((size_t) bulk_read(conn, (char*) book->sel[i], count * sizeof(int16_t)) != count * sizeof(int16_t)) {
+			return -1;
+		}
+	}
+	for(i = 0; i < hdr->ticket_count; ++i) {
+		if(book->player[i] < 0 || book->player[i] >= MAX_PLAYERS || !args->players[book->player[i]] || book->type[i] >= BET_TYPES) {
+			return -1;
+		}
+		for(j = 0; j <= book->type[i]; ++j) {
+			if(book->sel[j][i] < 0 || book->sel[j][i] >= args->horse_count) {
+				return -1;
+			}
+		}
+	}
+	book->count = hdr->ticket_count;
+	memcpy(book->pool, hdr->pools, sizeof(book->pool));
+	return 0;
+}
+
+/*
+* Takes over ledger, upcoming race and sockets of the previous process.
+* Client sockets are kept in h->adopted until handoff_adopt serves them.
+* Any inconsistency ends the process, the previous one then resumes service.
+*
+* @h:    handoff state of the process
+* @conn: socket returned by handoff_connect
+*
+* Returns listening socket of the previous process.
+*/
+int handoff_receive(handoff_state* h, int conn) {
+	acc_clients_args* args = h->args;
+	handoff_header hdr;
+	handoff_player pl;
+	player* p;
+	float rest;
+	int32_t index;
+	int i, sock;
+
+	if(bulk_read(conn, (char*) &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || hdr.horse_count != args->horse_count ||
+		hdr.player_count < 0 || hdr.player_count > MAX_PLAYERS || hdr.session_count < 0) {
+		goto failed;
+	}
+	*args->bank = hdr.bank;
+	*args->winner = (hdr.winner >= 0 && hdr.winner < args->horse_count) ? &args->horses[hdr.winner] : NULL;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if(hdr.field[i] >= 0 && hdr.field[i] < args->horse_count) {
+			(*args->curr_running_horses)[i] = &args->horses[hdr.field[i]];
+			args->horses[hdr.field[i]].running = 1;
+		}
+	}
+	*args->time = hdr.next_start - *args->interval;
+	h->resumed = 1;
+
+	for(i = 0; i < hdr.player_count; ++i) {
+		if(bulk_read(conn, (char*) &pl, sizeof(pl)) != sizeof(pl) || pl.index < 0 || pl.index >= MAX_PLAYERS || args->players[pl.index]) {
+			goto failed;
+		}
+		p = args->players[pl.index] = (player*) pool_alloc(POOL_PLAYERS);
+		memcpy(p->name, pl.name, MAX_NAME_LEN);
+		p->name[MAX_NAME_LEN - 1] = '\0';
+		p->money = pl.money;
+		p->token = pl.token;
+		if(pl.horse_bet >= 0 && pl.horse_bet < args->horse_count) {
+			p->horse_bet = &args->horses[pl.horse_bet];
+			p->money_bet = pl.money_bet;
+		}
+	}
+	for(i = 0; i < args->horse_count; ++i) {
+		if(bulk_read(conn, (char*) &rest, sizeof(rest)) != sizeof(rest)) {
+			goto failed;
+		}
+		args->horses[i].rest_factor = rest;
+	}
+	if(handoff_receive_book(conn, &hdr, args) < 0) {
+		goto failed;
+	}
+
+	if( (sock = handoff_recv_fd(conn, &index)) < 0) {
+		goto failed;
+	}
+	if(hdr.local_listener && (args->local_socket = handoff_recv_fd(conn, &index)) < 0) {
+		goto failed;
+	}
+	if(hdr.replica_listener && (args->replica->listen_fd = handoff_recv_fd(conn, &index)) < 0) {
+		goto failed;
+	}
+	if(hdr.session_count > 0 && (h->adopted = (handoff_session*) calloc(hdr.session_count, sizeof(handoff_session))) == NULL) {
+		ERR("calloc");
+	}
+	for(h->adopted_count = 0; h->adopted_count < hdr.session_count; ++h->adopted_count) {
+		if( (h->adopted[h->adopted_count].socket = handoff_recv_fd(conn, &index)) < 0) {
+			goto failed;
+		}
+		h->adopted[h->adopted_count].index = (index >= 0 && index < MAX_PLAYERS && args->players[index]) ? index : -1;
+	}
+	publish_field(args->snapshots, *args->curr_running_horses);
+	return sock;
+
+failed:
+	fprintf(stderr, "Previous server sent incompatible state, it keeps running.\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+* Serves sessions received from the previous process and lets it exit.
+* With io_uring backend it has to run before the loop thread starts.
+*
+* @h:    handoff state of the process
+* @conn: socket returned by handoff_connect
+*/
+void handoff_adopt(handoff_state* h, int conn) {
+	player_th_data* session;
+	pthread_attr_t thattr;
+	pthread_t id;
+	int i;
+
+	if(pthread_attr_init(&thattr) != 0) {
+		ERR("pthread_attr_init");
+	}
+	if(pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED) != 0) {
+		ERR("pthread_attr_setdetachstate");
+	}
+	for(i = 0; i < h->adopted_count; ++i) {
+		session = new_session(h->args, h->adopted[i].socket);
+		session->index = h->adopted[i].index;
+		session->adopted = 1;
+		if(h->loop) {
+			uring_add_session(h->loop, session);
+		} else if(pthread_create(&id, &thattr, handle_connection, (void*) session) != 0) {
+			ERR("pthread_create");
+		}
+	}
+	if(pthread_attr_destroy(&thattr) != 0) {
+		ERR("pthread_attr_destroy");
+	}
+
+	if(bulk_write(conn, "1", 1) < 0) {
+		ERR("write");
+	}
+	if(TEMP_FAILURE_RETRY(close(conn)) < 0) {
+		ERR("close");
+	}
+	fprintf(stderr, "Took over %d sessions from the previous server.\n", h->adopted_count);
+}
+
+/*
+* Sets default values of optional configuration entries.
+*/
+void default_conf(server_conf* conf) {
+	memset(conf, 0, sizeof(server_conf));
+	conf->io_backend = IO_BACKEND_THREADS;
+	conf->replica_ack_ms = REPLICA_ACK_MS;
+	conf->cmd.rate = 100;
+	conf->cmd.burst = 200;
+	conf->bet.rate = 10;
+	conf->bet.burst = 20;
+	conf->ip_cmd.rate = 1000;
+	conf->ip_cmd.burst = 2000;
+	conf->ip_bet.rate = 100;
+	conf->ip_bet.burst = 200;
+}
+
+/*
+* Parses "rate burst" pair of a rate limit entry.
+*/
+void read_rate_limit(rate_limit* limit, char* value) {
+	char* end;
+
+	limit->rate = strtod(value, &end);
+	limit->burst = strtod(end, NULL);
+	if(limit->burst < 1) {
+		limit->burst = (limit->rate > 1) ? limit->rate : 1;
+	}
+}
+
+/*
+* Parses list of CPUs like "0-3,6" of a thread role.
+*/
+void read_cpu_list(thread_role* role, char* value) {
+	char* end;
+	long first, last;
+
+	CPU_ZERO(&role->cpus);
+	role->pinned = 0;
+	while(*value) {
+		first = last = strtol(value, &end, 10);
+		if(end != value && *end == '-') {
+			value = end + 1;
+			last = strtol(value, &end, 10);
+		}
+		if(end == value || first < 0 || last >= CPU_SETSIZE) {
+			fprintf(stderr, "Malformed CPU list: %s\n", value);
+			CPU_ZERO(&role->cpus);
+			role->pinned = 0;
+			return;
+		}
+		for(; first <= last; ++first) {
+			CPU_SET(first, &role->cpus);
+			role->pinned = 1;
+		}
+		value = end + strspn(end, ", \t");
+	}
+}
+
+/*
+* Parses list of users like "1000, 1001" allowed on the unix socket.
+*/
+void read_uid_list(local_listener* local, char* value) {
+	char* end;
+	unsigned long uid;
+
+	local->uid_count = 0;
+	while(*value && local->uid_count < LOCAL_MAX_UIDS) {
+		uid = strtoul(value, &end, 10);
+		if(end == value) {
+			fprintf(stderr, "Malformed user list: %s\n", value);
+			return;
+		}
+		local->uids[local->uid_count++] = (uid_t) uid;
+		value = end + strspn(end, ", \t");
+	}
+}
+
+/*
+* Parses one optional "KEY: value" configuration line.
+* Unknown keys are reported and ignored.
+*
+* @conf: configuration being read
+* @line: line read from the configuration file
+*/
+void read_conf_option(server_conf* conf, char* line) {
+	char* value;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	if( (value = strchr(line, ':')) == NULL) {
+		return;
+	}
+	*value++ = '\0';
+	value += strspn(value, " \t");
+
+	if(!strcmp(line, "IO_BACKEND")) {
+		if(!strcmp(value, "uring")) {
+			conf->io_backend = IO_BACKEND_URING;
+		} else if(!strcmp(value, "threads")) {
+			conf->io_backend = IO_BACKEND_THREADS;
+		} else {
+			fprintf(stderr, "Unknown IO_BACKEND: %s\n", value);
+		}
+	} else if(!strcmp(line, "RATE_CMD")) {
+		read_rate_limit(&conf->cmd, value);
+	} else if(!strcmp(line, "RATE_BET")) {
+		read_rate_limit(&conf->bet, value);
+	} else if(!strcmp(line, "RATE_IP_CMD")) {
+		read_rate_limit(&conf->ip_cmd, value);
+	} else if(!strcmp(line, "RATE_IP_BET")) {
+		read_rate_limit(&conf->ip_bet, value);
+	} else if(!strcmp(line, "CPU_RACE")) {
+		read_cpu_list(&conf->roles[ROLE_RACE], value);
+	} else if(!strcmp(line, "CPU_IO")) {
+		read_cpu_list(&conf->roles[ROLE_IO], value);
+	} else if(!strcmp(line, "CPU_ACCEPT")) {
+		read_cpu_list(&conf->roles[ROLE_ACCEPT], value);
+	} else if(!strcmp(line, "CPU_STATE")) {
+		read_cpu_list(&conf->roles[ROLE_STATE], value);
+	} else if(!strcmp(line, "RACE_PRIORITY")) {
+		conf->roles[ROLE_RACE].priority = atoi(value);
+	} else if(!strcmp(line, "TRACE")) {
+		conf->trace_events = strtoul(value, NULL, 10);
+	} else if(!strcmp(line, "UPGRADE_SOCKET")) {
+		strncpy(conf->upgrade_path, value, HANDOFF_PATH_LEN - 1);
+	} else if(!strcmp(line, "EXPORT_SHM")) {
+		strncpy(conf->export_name, value, NAME_MAX);
+	} else if(!strcmp(line, "LOCAL_SOCKET")) {
+		strncpy(conf->local.path, value, HANDOFF_PATH_LEN - 1);
+	} else if(!strcmp(line, "LOCAL_UIDS")) {
+		read_uid_list(&conf->local, value);
+	} else if(!strcmp(line, "REPLICA_SOCKET")) {
+		strncpy(conf->replica_path, value, HANDOFF_PATH_LEN - 1);
+	} else if(!strcmp(line, "REPLICA_ACK_MS")) {
+		conf->replica_ack_ms = atoi(value);
+	} else if(!strcmp(line, "JOURNAL_FILE")) {
+		strncpy(conf->journal_path, value, PATH_MAX - 1);
+	} else {
+		fprintf(stderr, "Unknown configuration entry: %s\n", line);
+	}
+}
+
+void read_configuration(horse** horses, horse** race_winner, int* horse_count, int* frequency, pthread_mutex_t* race_mutex, pthread_cond_t* race_cond, pthread_barrier_t* race_barrier, horse_args** hargs, server_conf* conf, server_metrics* metrics) {
+	FILE* file;
+	char buf[LINE_BUF];
+	int i;
+	char* b;
+	pthread_attr_t thattr;
+
+	if(pthread_attr_init(&thattr) != 0) {
+		ERR("pthread_attr_init");
+	}
+	if(pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED) != 0) {
+		ERR("pthread_attr_setdetachstate");
+	}
+	
+	memset(buf, 0, LINE_BUF);
+
+	if( (file = fopen(SERVER_CONF_FILE, "r")) == NULL) {
+		ERR("fopen");
+	}
+
+	/* Read frequency */
+	if(fgets(buf, LINE_BUF, file) == NULL) {
+		goto closed;
+	}
+
+	*frequency = atoi(buf + strlen("FREQUENCY:"));
+	*frequency = 3600 / *frequency;
+
+	/* Read horse count */
+	if(fgets(buf, LINE_BUF, file) == NULL) {
+		goto closed;
+	}
+
+	*horse_count = atoi(buf + strlen("HORSE_COUNT:"));
+
+	if( (*horses = (horse*) calloc(*horse_count, sizeof(horse))) == NULL) {
+		fclose(file);
+		ERR("calloc");
+	}
+
+	if( (*hargs = (horse_args*) calloc(*horse_count, sizeof(horse_args))) == NULL) {
+		fclose(file);
+		ERR("calloc");
+	}
+
+	
+	for(i = 0; i < *horse_count; ++i) {
+		if(fgets(buf, LINE_BUF, file) == NULL) {
+			goto closed;
+		}
+		b = strchr(buf, ' ') + 1;
+		strncpy((*horses)[i].name, b, MAX_NAME_LEN);
+		(*horses)[i].name[strlen(b) - 1] = '\0';
+		(*horses)[i].running = 0;
+		(*horses)[i].distance_run = 0;
+		(*horses)[i].rest_factor = 1;
+		(*horses)[i].mutex = race_mutex;
+		(*horses)[i].cond = race_cond;
+		(*horses)[i].barrier = race_barrier;
+
+		(*hargs)[i].winner = race_winner;
+		(*hargs)[i].metrics = metrics;
+		(*hargs)[i].horse_data = &(*horses)[i];
+	
+		if(pthread_create(&(*horses)[i].tid, &thattr, horse_thread, (void*) &((*hargs)[i])) != 0) {
+			ERR("pthread_create");
+		}
+	}
+
+	/* Read optional entries */
+	while(fgets(buf, LINE_BUF, file) != NULL) {
+		read_conf_option(conf, buf);
+	}
+
+closed:
+	if(fclose(file) == EOF) {
+		ERR("fclose");
+	}
+
+	if(pthread_attr_destroy(&thattr) != 0) {
+		ERR("pthread_attr_destroy");
+	}
+}
+
+/*
+* Draws horses running in the next race and marks them as running.
+*
+* @horses:      array of all horses
+* @horse_count: number of horses
+* @field:       destination, holds MAX_HORSES_PER_RACE horses
+* @seed:        state of rand_r
+*
+* Returns number of horses drawn.
+*/
+int draw_field(horse* horses, int horse_count, horse** field, unsigned int* seed) {
+	int in_running_index = 0, racing_horses = (MAX_HORSES_PER_RACE > horse_count) ? horse_count : MAX_HORSES_PER_RACE, i, index;
+
+	for(i = 0; i < racing_horses; ++i) {
+		index = rand_r(seed) % racing_horses;
+		if(horses[index].running == 0) {
+			horses[index].running = 1;
+			field[in_running_index++] = &horses[index];
+		}
+	}
+	return in_running_index;
+}
+
+int init_race(horse* horses, race_args* args) {
+	int count = 0, i;
+	unsigned int seed = time(NULL);
+
+	/* Field taken over from the previous process is kept */
+	while(count < MAX_HORSES_PER_RACE && (*args->curr_running_horses)[count]) {
+		++count;
+	}
+	if(count == 0) {
+		draw_field(horses, args->horse_count, *args->curr_running_horses, &seed);
+	}
+	for(count = 0; count < MAX_HORSES_PER_RACE && (*args->curr_running_horses)[count]; ++count);
+	pthread_barrier_init(args->barrier, NULL, count);
+
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if( (*args->curr_running_horses)[i]) {
+			printf("%s \t", (*args->curr_running_horses)[i]->name);
+		}
+	}
+	publish_field(args->snapshots, *args->curr_running_horses);
+	export_field(args->export);
+	replica_race(args->replica, REPLICA_FIELD, args, 0);
+
+	return count;
+}
+
+void wait_for_race(int* state, pthread_mutex_t* state_mutex, pthread_cond_t* state_cond) {
+
+	if(pthread_mutex_lock(state_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	while(*state != STATE_RACING && !exit_flag) {
+		printf("State: NOT_RACING\n");
+		if(pthread_cond_wait(state_cond, state_mutex) != 0) {
+			ERR("pthread_cond_wait");
+		}
+	}
+	printf("State: RACING\n");
+	if(pthread_mutex_unlock(state_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+}
+
+/*
+* Marks tickets of the chunk matching the finish order and sums their stakes by bet type.
+* Loops are branch-free over the columns so the compiler can vectorize them.
+*/
+void* settle_match(void* arg) {
+	settle_chunk* c = (settle_chunk*) arg;
+	bet_book* book = c->book;
+	long won_win = 0, won_exacta = 0, won_trifecta = 0, w;
+	int i;
+
+	for(i = c->begin; i < c->end; ++i) {
+		book->hit[i] = (book->sel[0][i] == c->order[0]) &
+			((book->sel[1][i] == c->order[1]) | (book->type[i] < BET_EXACTA)) &
+			((book->sel[2][i] == c->order[2]) | (book->type[i] < BET_TRIFECTA));
+	}
+	for(i = c->begin; i < c->end; ++i) {
+		w = book->hit[i] * (long) book->stake[i];
+		won_win += (book->type[i] == BET_WIN) * w;
+		won_exacta += (book->type[i] == BET_EXACTA) * w;
+		won_trifecta += (book->type[i] == BET_TRIFECTA) * w;
+	}
+	c->won[BET_WIN] = won_win;
+	c->won[BET_EXACTA] = won_exacta;
+	c->won[BET_TRIFECTA] = won_trifecta;
+	return NULL;
+}
+
+/*
+* Computes payouts of the chunk, every pool is shared by its matching tickets in proportion to stakes.
+*/
+void* settle_pay(void* arg) {
+	settle_chunk* c = (settle_chunk*) arg;
+	bet_book* book = c->book;
+	int i, type;
+
+	for(i = c->begin; i < c->end; ++i) {
+		type = book->type[i];
+		book->payout[i] = (book->hit[i]) ? (int32_t) ((long long) book->stake[i] * book->pool[type] / c->won[type]) : 0;
+	}
+	return NULL;
+}
+
+/*
+* Runs one settlement phase over all chunks, the calling thread takes the first chunk.
+*/
+void settle_phase(void* (*phase)(void*), settle_chunk* chunks, int count) {
+	pthread_t tids[SETTLE_MAX_WORKERS];
+	int i;
+
+	for(i = 1; i < count; ++i) {
+		if(pthread_create(&tids[i], NULL, phase, &chunks[i]) != 0) {
+			ERR("pthread_create");
+		}
+	}
+	phase(&chunks[0]);
+	for(i = 1; i < count; ++i) {
+		if(pthread_join(tids[i], NULL) != 0) {
+			ERR("pthread_join");
+		}
+	}
+}
+
+void journal_close(bet_journal* j) {
+	if(j->fd >= 0 && TEMP_FAILURE_RETRY(close(j->fd)) < 0) {
+		ERR("close");
+	}
+	j->fd = -1;
+}
+
+/*
+* Writes an entry with its columns, a failed write stops the journal instead of the server.
+*/
+void journal_write(bet_journal* j, struct iovec* iov, int iovcnt) {
+	if(bulk_writev(j->fd, iov, iovcnt) < 0) {
+		fprintf(stderr, "Journal write failed (%s), journal stopped.\n", strerror(errno));
+		journal_close(j);
+	}
+}
+
+/*
+* Opens the journal for appending, every process writes names of players again before their first ticket.
+* A torn entry left by a killed server is padded to 8 bytes, so new entries stay aligned behind it.
+*
+* @path: journal file (empty disables the journal)
+*/
+void journal_open(bet_journal* j, char* path) {
+	char pad[8] = {0};
+	struct iovec iov;
+	struct stat st;
 
-	FD_ZERO(&read_set);
-	FD_SET(socket, &read_set);
-	count = 1;
-	tv = ttv;
-	while(( (result = select(socket + 1, &read_set, NULL, NULL, &tv) || count)) && !exit_flag) {
-		if(result < 0 && errno != EINTR) {
-			ERR("select");
+	memset(j, 0, sizeof(bet_journal));
+	j->fd = -1;
+	if(path[0] && (j->fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644))) < 0) {
+		ERR("open");
+	}
+	if(j->fd >= 0 && fstat(j->fd, &st) == 0 && st.st_size % 8) {
+		iov.iov_base = pad;
+		iov.iov_len = 8 - st.st_size % 8;
+		journal_write(j, &iov, 1);
+	}
+}
+
+/*
+* Appends tickets of the settled race with their payouts, bank_mutex must be held.
+* Columns are written straight from the book in one system call.
+*
+* @order: indexes of horses finishing first to third (-1 if nobody)
+*/
+void journal_race(bet_journal* j, player** players, int16_t* order, bet_book* book) {
+	char pad[8] = {0};
+	struct iovec iov[9];
+	journal_entry e;
+	int i, slot, n = book->count;
+
+	if(!j || j->fd < 0) {
+		return;
+	}
+	for(i = 0; i < n; ++i) {
+		if(!j->named[slot = book->player[i]]) {
+			memset(&e, 0, sizeof(journal_entry));
+			e.magic = JOURNAL_MAGIC;
+			e.type = JOURNAL_PLAYER;
+			e.index = slot;
+			e.time = time(NULL);
+			memcpy(e.name, players[slot]->name, MAX_NAME_LEN);
+			iov[0].iov_base = &e;
+			iov[0].iov_len = sizeof(journal_entry);
+			journal_write(j, iov, 1);
+			j->named[slot] = 1;
 		}
-		tv = ttv;
-		if(FD_ISSET(socket, &read_set)) {
-			route_cmd(socket, index, data, players);
-		} else {
-			notify_race_info(data, socket);
+	}
+	memset(&e, 0, sizeof(journal_entry));
+	e.magic = JOURNAL_MAGIC;
+	e.type = JOURNAL_RACE;
+	e.count = n;
+	e.time = time(NULL);
+	memcpy(e.pools, book->pool, sizeof(e.pools));
+	memcpy(e.order, order, sizeof(e.order));
+	iov[0].iov_base = &e;
+	iov[0].iov_len = sizeof(journal_entry);
+	iov[1].iov_base = book->player;
+	iov[1].iov_len = n * sizeof(int32_t);
+	iov[2].iov_base = book->stake;
+	iov[2].iov_len = n * sizeof(int32_t);
+	iov[3].iov_base = book->payout;
+	iov[3].iov_len = n * sizeof(int32_t);
+	for(i = 0; i < BET_PLACES; ++i) {
+		iov[4 + i].iov_base = book->sel[i];
+		iov[4 + i].iov_len = n * sizeof(int16_t);
+	}
+	iov[7].iov_base = book->type;
+	iov[7].iov_len = n * sizeof(uint8_t);
+	iov[8].iov_base = pad;
+	iov[8].iov_len = (8 - (n * (3 * sizeof(int32_t) + BET_PLACES * sizeof(int16_t) + sizeof(uint8_t))) % 8) % 8;
+	if(j->fd >= 0) {
+		journal_write(j, iov, 9);
+	}
+}
+
+/*
+* Settles all tickets of the race against its finish order and empties the book.
+* Matching and payouts run in parallel over chunks of the columns, balances are then updated in one pass.
+* Pools without a matching ticket carry over to the next race.
+*
+* @order:   indexes of horses finishing first to third (-1 if nobody)
+* @replica: replication the settlement is passed on to (NULL if none)
+* @journal: journal the settled tickets are appended to (NULL if none)
+*/
+void manage_prizes(int* bank, player** players, int16_t* order, bet_book* book, pthread_mutex_t* bank_mutex, replica_state* replica, bet_journal* journal) {
+	settle_chunk chunks[SETTLE_MAX_WORKERS];
+	long won[BET_TYPES] = {0}, cpus;
+	int i, j, workers, per_worker;
+	player* pl;
+
+	if(pthread_mutex_lock(bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = (book->count + SETTLE_CHUNK - 1) / SETTLE_CHUNK;
+	workers = (workers > cpus) ? cpus : workers;
+	workers = (workers > SETTLE_MAX_WORKERS) ? SETTLE_MAX_WORKERS : workers;
+	workers = (workers < 1) ? 1 : workers;
+	per_worker = (book->count + workers - 1) / workers;
+	for(i = 0; i < workers; ++i) {
+		chunks[i].book = book;
+		chunks[i].begin = i * per_worker;
+		chunks[i].end = (book->count < (i + 1) * per_worker) ? book->count : (i + 1) * per_worker;
+		memcpy(chunks[i].order, order, sizeof(chunks[i].order));
+	}
+	settle_phase(settle_match, chunks, workers);
+	for(i = 0; i < workers; ++i) {
+		for(j = 0; j < BET_TYPES; ++j) {
+			won[j] += chunks[i].won[j];
 		}
-		FD_ZERO(&read_set);
-		FD_SET(socket, &read_set);
 	}
+	for(i = 0; i < workers; ++i) {
+		memcpy(chunks[i].won, won, sizeof(won));
+	}
+	settle_phase(settle_pay, chunks, workers);
+	journal_race(journal, players, order, book);
 
-	fprintf(stderr, "Connection ended.\n");
-	free(th_data);
-	pthread_exit(NULL);
+	for(i = 0; i < book->count; ++i) {
+		pl = players[book->player[i]];
+		pl->money += book->payout[i];
+		pl->horse_bet = NULL;
+		pl->money_bet = 0;
+		book->pool[book->type[i]] -= book->payout[i];
+		*bank -= book->payout[i];
+	}
+	book->count = 0;
+	replica_settle(replica, order);
+	if(pthread_mutex_unlock(bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
 }
 
-int make_socket(uint16_t port) {
-	struct sockaddr_in name;
-	int sock, t = 1;
-	sock = socket(PF_INET, SOCK_STREAM, 0);
-	if(sock < 0) {
-		ERR("socket");
+/*
+* Ranks the field after a race: the winner first, then the others by distance run.
+*
+* @order: destination for indexes of horses finishing first to third (-1 if nobody)
+*/
+void finish_order(race_args* args, int16_t* order) {
+	horse* ranked[MAX_HORSES_PER_RACE], *h;
+	int count = 0, i, j;
+
+	for(i = 0; i < BET_PLACES; ++i) {
+		order[i] = -1;
+	}
+	if(!*args->winner) {
+		return;
+	}
+	ranked[count++] = *args->winner;
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if( (h = (*args->curr_running_horses)[i]) == NULL || h == *args->winner) {
+			continue;
+		}
+		for(j = count; j > 1 && ranked[j - 1]->distance_run < h->distance_run; --j) {
+			ranked[j] = ranked[j - 1];
+		}
+		ranked[j] = h;
+		++count;
+	}
+	for(i = 0; i < BET_PLACES && i < count; ++i) {
+		order[i] = ranked[i] - args->horses;
 	}
+}
 
-	name.sin_family = AF_INET;
-	name.sin_port = htons(port);
-	name.sin_addr.s_addr = htonl(INADDR_ANY);
+void replica_init(replica_state* r, char* path, int ack_ms, acc_clients_args* args) {
+	pthread_condattr_t attr;
 
-	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)) < 0) {
-		ERR("setsockopt");
+	memset(r, 0, sizeof(replica_state));
+	r->listen_fd = r->fd = r->wake_fd = r->notify_fd = -1;
+	strncpy(r->path, path, HANDOFF_PATH_LEN - 1);
+	r->ack_ms = ack_ms;
+	r->args = args;
+	if(pthread_mutex_init(&r->mutex, NULL) != 0) {
+		ERR("pthread_mutex_init");
 	}
-	if(bind(sock, (struct sockaddr*) &name, sizeof(name)) < 0) {
-		ERR("bind");
+	/* Bets wait on monotonic deadlines, like the race turns */
+	if(pthread_condattr_init(&attr) != 0) {
+		ERR("pthread_condattr_init");
 	}
-	if(listen(sock, BACKLOG) < 0) {
-		ERR("listen");
+	if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0) {
+		ERR("pthread_condattr_setclock");
+	}
+	if(pthread_cond_init(&r->acked_cond, &attr) != 0) {
+		ERR("pthread_cond_init");
+	}
+	if(pthread_condattr_destroy(&attr) != 0) {
+		ERR("pthread_condattr_destroy");
 	}
-	
-	return sock;
 }
 
-void run_race(horse* data, horse_args* args) {
-	float distance;
-	while(data->running && !(*args->winner) && !exit_flag) {
-		distance = data->rest_factor * MAX_HORSE_SPEED + (rand() % 5);
-		data->distance_run += distance;
-		data->rest_factor -= distance * 0.001;
+/*
+* Connects the standby and queues a snapshot of ledger and race state ahead of any later change.
+* Commands and settlement are held off while the snapshot is taken.
+*/
+void replica_attach(replica_state* r, int conn) {
+	acc_clients_args* args = r->args;
+	replica_record rec;
+	int i;
 
-		if(data->running && !(*args->winner)) {
-			fprintf(stderr, "Horse: %s\tDistance run: %d, Rest Factor: %f\n", data->name, data->distance_run, data->rest_factor);
+	if(pthread_rwlock_wrlock(&args->handoff->ledger_lock) != 0) {
+		ERR("pthread_rwlock_wrlock");
+	}
+	if(pthread_mutex_lock(args->bank_mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	r->fd = conn;
+	r->queued = 0;
+	r->seq = r->acked = 0;
+	replica_append_locked(r, replica_rec(&rec, REPLICA_RESET));
+	for(i = 0; i < args->horse_count; ++i) {
+		replica_rec(&rec, REPLICA_HORSE);
+		rec.index = i;
+		rec.rest[0] = args->horses[i].rest_factor;
+		replica_append_locked(r, &rec);
+	}
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if(args->players[i]) {
+			replica_fill_player(replica_rec(&rec, REPLICA_PLAYER), i, args->players[i]);
+			replica_append_locked(r, &rec);
 		}
-		
-		if(data->distance_run >= RACE_DISTANCE) {
-			data->running = 0;
-			if(pthread_mutex_lock(data->mutex) != 0) {
+	}
+	for(i = 0; i < args->book->count; ++i) {
+		replica_fill_ticket(replica_rec(&rec, REPLICA_BET), args->book, i, args->players[args->book->player[i]], *args->bank);
+		replica_append_locked(r, &rec);
+	}
+	replica_fill_field(replica_rec(&rec, REPLICA_SYNC), args->horses, *args->curr_running_horses);
+	rec.arg = (*args->winner) ? *args->winner - args->horses : -1;
+	rec.bank = *args->bank;
+	memcpy(rec.pools, args->book->pool, sizeof(rec.pools));
+	rec.next_start = *args->time + *args->interval;
+	replica_append_locked(r, &rec);
+	fprintf(stderr, "Standby connected, snapshot of %llu records.\n", (unsigned long long) r->seq);
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	if(pthread_mutex_unlock(args->bank_mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	if(pthread_rwlock_unlock(&args->handoff->ledger_lock) != 0) {
+		ERR("pthread_rwlock_unlock");
+	}
+}
+
+/*
+* Drops the standby, bets stop waiting for it.
+*/
+void replica_detach(replica_state* r) {
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	if(TEMP_FAILURE_RETRY(close(r->fd)) < 0) {
+		ERR("close");
+	}
+	r->fd = -1;
+	r->queued = 0;
+	r->spare_len = r->spare_sent = 0;
+	if(pthread_cond_broadcast(&r->acked_cond) != 0) {
+		ERR("pthread_cond_broadcast");
+	}
+	if(r->notify_fd >= 0 && eventfd_write(r->notify_fd, 1) < 0) {
+		ERR("eventfd_write");
+	}
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	fprintf(stderr, "Standby disconnected.\n");
+}
+
+/*
+* Sends queued records to the standby, the queue is swapped out so producers never wait for the socket.
+* The socket is non-blocking and written in chunks of REPLICA_CHUNK, what it does not take stays in spare
+* until it is writable again. The sender keeps reading acknowledgements meanwhile, so a standby blocked
+* writing one cannot stall the leader writing records to it.
+*
+* Returns 0 on success, -1 when the standby is gone.
+*/
+int replica_flush(replica_state* r) {
+	char* buf;
+	size_t capacity;
+	ssize_t len;
+
+	while(1) {
+		if(r->spare_sent == r->spare_len) {
+			if(pthread_mutex_lock(&r->mutex) != 0) {
 				ERR("pthread_mutex_lock");
 			}
-			if(!(*args->winner)) {
-				*args->winner = data;
-				fprintf(stderr, "Horse: %s won!\n", data->name);
+			buf = r->queue;
+			capacity = r->capacity;
+			r->spare_len = r->queued;
+			r->spare_sent = 0;
+			r->queue = r->spare;
+			r->capacity = r->spare_capacity;
+			r->queued = 0;
+			r->spare = buf;
+			r->spare_capacity = capacity;
+			if(pthread_mutex_unlock(&r->mutex) != 0) {
+				ERR("pthread_mutex_unlock");
 			}
-			
-			fprintf(stderr, "Horse: %s waiting on cond...\n", data->name);
-			if(pthread_cond_wait(data->cond, data->mutex) != 0) {
-				ERR("pthread_cond_wait");
+			if(r->spare_len == 0) {
+				return 0;
 			}
-			if(pthread_mutex_unlock(data->mutex) != 0) {
-				ERR("pthread_mutex_unlock");
+		}
+		/* Only the sender closes the socket, it stays valid outside the mutex */
+		len = TEMP_FAILURE_RETRY(write(r->fd, r->spare + r->spare_sent,
+			(r->spare_len - r->spare_sent < REPLICA_CHUNK) ? r->spare_len - r->spare_sent : REPLICA_CHUNK));
+		if(len < 0) {
+			return (errno == EAGAIN) ? 0 : -1;
+		}
+		r->spare_sent += len;
+	}
+}
+
+/*
+* Reads acknowledgements, the standby sends the number of records applied after every batch.
+*
+* Returns 0 on success, -1 when the standby is gone.
+*/
+int replica_read_acks(replica_state* r) {
+	uint64_t acks[64];
+	ssize_t len;
+
+	if( (len = TEMP_FAILURE_RETRY(read(r->fd, acks, sizeof(acks)))) < 0 && errno == EAGAIN) {
+		return 0;
+	}
+	if(len <= 0 || len % sizeof(uint64_t)) {
+		return -1;
+	}
+	if(pthread_mutex_lock(&r->mutex) != 0) {
+		ERR("pthread_mutex_lock");
+	}
+	r->acked = acks[len / sizeof(uint64_t) - 1];
+	if(pthread_cond_broadcast(&r->acked_cond) != 0) {
+		ERR("pthread_cond_broadcast");
+	}
+	if(r->notify_fd >= 0 && eventfd_write(r->notify_fd, 1) < 0) {
+		ERR("eventfd_write");
+	}
+	if(pthread_mutex_unlock(&r->mutex) != 0) {
+		ERR("pthread_mutex_unlock");
+	}
+	return 0;
+}
+
+/*
+* Serves one standby at a time: sends it a snapshot, then streams queued records and collects acknowledgements.
+*/
+void* replica_sender(void* arg) {
+	replica_state* r = (replica_state*) arg;
+	struct pollfd pfd[3];
+	uint64_t wakeups;
+	int conn;
+
+	while(!r->stopping) {
+		pfd[0].fd = (r->fd < 0 && !__atomic_load_n(&r->handed_over, __ATOMIC_ACQUIRE)) ? r->listen_fd : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = r->fd;
+		/* Records the socket did not take go out once it is writable */
+		pfd[1].events = POLLIN | ((r->spare_sent < r->spare_len) ? POLLOUT : 0);
+		pfd[2].fd = r->wake_fd;
+		pfd[2].events = POLLIN;
+		if(poll(pfd, 3, -1) < 0) {
+			if(errno == EINTR) continue;
+			ERR("poll");
+		}
+		if(pfd[2].revents & POLLIN) {
+			if(eventfd_read(r->wake_fd, &wakeups) < 0) {
+				ERR("eventfd_read");
 			}
-		
-			fprintf(stderr, "Horse: %s waiting on barrier...\n", data->name);
-			pthread_barrier_wait(data->barrier);
+			if(r->fd >= 0 && replica_flush(r) < 0) {
+				replica_detach(r);
+			}
+		}
+		if(r->fd >= 0 && (pfd[1].revents & (POLLIN | POLLERR | POLLHUP)) && replica_read_acks(r) < 0) {
+			replica_detach(r);
+		}
+		if(r->fd >= 0 && (pfd[1].revents & POLLOUT) && replica_flush(r) < 0) {
+			replica_detach(r);
+		}
+		if((pfd[0].revents & POLLIN) && !__atomic_load_n(&r->handed_over, __ATOMIC_ACQUIRE)) {
+			if( (conn = accept(r->listen_fd, NULL, NULL)) < 0) {
+				if(errno == EINTR || errno == ECONNABORTED) continue;
+				ERR("accept");
+			}
+			if(!local_peer_owned(conn, "standby")) {
+				continue;
+			}
+			if(fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK) < 0) {
+				ERR("fcntl");
+			}
+			replica_attach(r, conn);
+			if(replica_flush(r) < 0) {
+				replica_detach(r);
+			}
+		}
+	}
+	pthread_exit(NULL);
+}
 
-			data->distance_run = 0;
-			break;
+/*
+* Starts accepting the standby on the replica socket, or on the one received from the previous build.
+*/
+void replica_listen(replica_state* r) {
+	if(r->listen_fd < 0) {
+		r->listen_fd = make_local_socket(r->path, 0600);
+	}
+	if( (r->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		ERR("eventfd");
+	}
+	if(pthread_create(&r->tid, NULL, replica_sender, (void*) r) != 0) {
+		ERR("pthread_create");
+	}
+}
+
+void replica_destroy(replica_state* r) {
+	if(r->listen_fd >= 0) {
+		r->stopping = 1;
+		if(eventfd_write(r->wake_fd, 1) < 0) {
+			ERR("eventfd_write");
 		}
-		if(pthread_mutex_lock(data->mutex) != 0) {
-			ERR("pthread_mutex_lock");
+		if(pthread_join(r->tid, NULL) != 0) {
+			ERR("pthread_join");
 		}
-			fprintf(stderr, "Horse: %s waiting on cond...\n", data->name);
-		if(pthread_cond_wait(data->cond, data->mutex) != 0) {
-			ERR("pthread_cond_wait");
+		if(r->fd >= 0 && TEMP_FAILURE_RETRY(close(r->fd)) < 0) {
+			ERR("close");
 		}
-		if(pthread_mutex_unlock(data->mutex) != 0) {
-			ERR("pthread_mutex_unlock");
+		if(TEMP_FAILURE_RETRY(close(r->listen_fd)) < 0 || TEMP_FAILURE_RETRY(close(r->wake_fd)) < 0) {
+			ERR("close");
 		}
-		
-		fprintf(stderr, "Horse: %s waiting on barrier...\n", data->name);
-		pthread_barrier_wait(data->barrier);
+		if(r->path[0] != '@') {
+			unlink(r->path);
+		}
+	}
+	free(r->queue);
+	free(r->spare);
+	if(pthread_mutex_destroy(&r->mutex) != 0) {
+		ERR("pthread_mutex_destroy");
+	}
+	if(pthread_cond_destroy(&r->acked_cond) != 0) {
+		ERR("pthread_cond_destroy");
 	}
 }
 
-void* horse_thread(void* arg) {
-	horse_args* args = (horse_args*) arg;
-	horse* data = args->horse_data;
-	time_t start, end, dif;
-	
-	while(!exit_flag) {
-		start = time(NULL);
-		if(pthread_mutex_lock(data->mutex) != 0) {
-			ERR("pthread_mutex_lock");
+/*
+* Connects to the leader's replica socket.
+*
+* Returns connected socket, -1 when no leader listens on the path.
+*/
+int replica_connect(char* path) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	int sock;
+
+	if( (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		ERR("socket");
+	}
+	len = local_address(&addr, path);
+	if(connect(sock, (struct sockaddr*) &addr, len) < 0) {
+		if(errno != ENOENT && errno != ECONNREFUSED) {
+			ERR("connect");
 		}
-		while(!data->running && !exit_flag) {
-			if(pthread_cond_wait(data->cond, data->mutex) != 0) {
-				ERR("pthread_cond_wait");
+		if(TEMP_FAILURE_RETRY(close(sock)) < 0) {
+			ERR("close");
+		}
+		return -1;
+	}
+	return sock;
+}
+
+/*
+* Places the field of the record, with distances run and rest factors.
+*/
+void replica_apply_field(acc_clients_args* args, replica_record* rec) {
+	horse** field = *args->curr_running_horses;
+	int i;
+
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if( (field[i] = (rec->horses[i] >= 0) ? &args->horses[rec->horses[i]] : NULL) ) {
+			field[i]->distance_run = rec->distance[i];
+			field[i]->rest_factor = rec->rest[i];
+		}
+	}
+}
+
+/*
+* Applies a record of the leader to the standby's copy of the state.
+* Horses of the field are not marked as running, the standby only simulates races once promoted.
+*
+* Returns 0 on success, -1 for a record the standby cannot apply.
+*/
+int replica_apply(acc_clients_args* args, replica_record* rec) {
+	horse** field = *args->curr_running_horses;
+	player** players = args->players;
+	player* p;
+	int i;
+
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if(rec->horses[i] < -1 || rec->horses[i] >= args->horse_count) {
+			return -1;
+		}
+	}
+	switch(rec->type) {
+		case REPLICA_RESET:
+			/* A leader that started fresh knows nothing of players or the race of an earlier one */
+			for(i = 0; i < MAX_PLAYERS; ++i) {
+				if(players[i]) {
+					pool_free(POOL_PLAYERS, players[i]);
+					players[i] = NULL;
+				}
+			}
+			for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+				if(field[i]) {
+					field[i]->distance_run = 0;
+				}
+				field[i] = NULL;
+			}
+			*args->winner = NULL;
+			*args->bank = 0;
+			args->book->count = 0;
+			memset(args->book->pool, 0, sizeof(args->book->pool));
+			break;
+		case REPLICA_HORSE:
+			if(rec->index < 0 || rec->index >= args->horse_count) {
+				return -1;
+			}
+			args->horses[rec->index].rest_factor = rec->rest[0];
+			break;
+		case REPLICA_PLAYER:
+			if(rec->index < 0 || rec->index >= MAX_PLAYERS) {
+				return -1;
+			}
+			if( (p = players[rec->index]) == NULL) {
+				p = players[rec->index] = (player*) pool_alloc(POOL_PLAYERS);
+			}
+			memcpy(p->name, rec->name, MAX_NAME_LEN);
+			p->name[MAX_NAME_LEN - 1] = '\0';
+			p->money = rec->money;
+			p->token = rec->token;
+			break;
+		case REPLICA_MONEY:
+			if(rec->index < 0 || rec->index >= MAX_PLAYERS || !players[rec->index]) {
+				return -1;
+			}
+			players[rec->index]->money = rec->money;
+			break;
+		case REPLICA_BET:
+			if(rec->index < 0 || rec->index >= MAX_PLAYERS || !players[rec->index] || rec->arg < 0 || rec->arg >= BET_TYPES) {
+				return -1;
+			}
+			for(i = 0; i <= rec->arg; ++i) {
+				if(rec->horses[i] < 0) {
+					return -1;
+				}
+			}
+			book_add(args->book, rec->index, rec->arg, rec->horses, rec->stake);
+			p = players[rec->index];
+			p->money = rec->money;
+			p->horse_bet = &args->horses[rec->horses[0]];
+			p->money_bet = rec->stake;
+			*args->bank = rec->bank;
+			break;
+		case REPLICA_FIELD:
+			replica_apply_field(args, rec);
+			break;
+		case REPLICA_COUNTDOWN:
+			*args->time = rec->next_start - *args->interval;
+			break;
+		case REPLICA_TICK:
+			for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+				if(field[i]) {
+					field[i]->distance_run = rec->distance[i];
+					field[i]->rest_factor = rec->rest[i];
+				}
+			}
+			if(rec->arg == 0) {
+				*args->winner = NULL;
+			}
+			break;
+		case REPLICA_SETTLE:
+			manage_prizes(args->bank, players, rec->horses, args->book, args->bank_mutex, NULL, NULL);
+			*args->winner = (rec->horses[0] >= 0) ? &args->horses[rec->horses[0]] : NULL;
+			for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+				if(field[i]) {
+					field[i]->distance_run = 0;
+				}
+				field[i] = NULL;
+			}
+			break;
+		case REPLICA_SYNC:
+			if(rec->arg < -1 || rec->arg >= args->horse_count) {
+				return -1;
 			}
-			fprintf(stderr, "horse: %s awaken!, running: %d\n", data->name, data->running);
+			replica_apply_field(args, rec);
+			*args->winner = (rec->arg >= 0) ? &args->horses[rec->arg] : NULL;
+			*args->bank = rec->bank;
+			memcpy(args->book->pool, rec->pools, sizeof(args->book->pool));
+			*args->time = rec->next_start - *args->interval;
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/*
+* Waits for the build taking over from a leader that stopped on purpose.
+*
+* Returns socket connected to the new leader, -1 if none showed up.
+*/
+int replica_reconnect(char* path) {
+	struct timespec ts = {0, REPLICA_RETRY_MS * (NSEC_PER_SEC / 1000)};
+	int i, conn;
+
+	for(i = 0; i < REPLICA_RETRIES; ++i) {
+		nanosleep(&ts, NULL);
+		if( (conn = replica_connect(path)) >= 0) {
+			return conn;
 		}
-		if(pthread_mutex_unlock(data->mutex) != 0) {
-			ERR("pthread_mutex_unlock");
+	}
+	return -1;
+}
+
+/*
+* Turns the standby's copy of the state into a running server.
+* Betting window keeps its replicated start, a race cut short resumes from the replicated distances.
+*/
+void replica_promote(acc_clients_args* args) {
+	horse** field = *args->curr_running_horses;
+	int i;
+
+	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
+		if(field[i]) {
+			field[i]->running = 1;
 		}
-		
-		end = time(NULL);
-		
-		dif = end - start;
+	}
+	args->handoff->resumed = 1;
+	publish_field(args->snapshots, field);
+}
 
-		data->rest_factor += dif * 0.05;
-		data->rest_factor = (data->rest_factor >= 1) ? 1 : data->rest_factor;
-	
-		run_race(data, args);
+/*
+* Closes the connection to the leader and connects again if the leader still listens.
+* A leader drops a standby that fell behind or broke the stream, the standby then follows it again
+* from a fresh snapshot instead of taking over the port of a live leader.
+*
+* Returns new connection, -1 when the leader is gone.
+*/
+int replica_rejoin(replica_state* r, int conn) {
+	if(TEMP_FAILURE_RETRY(close(conn)) < 0) {
+		ERR("close");
 	}
-	pthread_exit(NULL);
+	if( (conn = replica_connect(r->path)) >= 0) {
+		fprintf(stderr, "Dropped by the leader, following it again.\n");
+	}
+	return conn;
 }
 
-void* server_accept_connections(void* arg) {
-	acc_clients_args* args = (acc_clients_args*) arg;
-	int sock, i=0, socket = args->socket;
-	pthread_t id[MAX_HORSES_PER_RACE];
-	pthread_attr_t thattr;
-	player** players = args->players;
-	player_th_data* thread_data;
+/*
+* Follows the leader as hot standby, applying its records and acknowledging every batch.
+* Returns when the leader is lost, so that this process takes over. Exits when the leader stopped
+* on purpose and no build took over from it, or on SIGINT.
+* Returns at once when no leader listens, this process then starts as the leader.
+*/
+void replica_follow(replica_state* r) {
+	acc_clients_args* args = r->args;
+	replica_record* recs;
+	struct pollfd pfd;
+	sigset_t unblocked;
+	size_t have = 0, i, count;
+	uint64_t applied = 0;
+	ssize_t len;
+	int conn;
 
-	single_pthread_sigmask(SIG_UNBLOCK, SIGUSR1);
-	
-	if(pthread_attr_init(&thattr) != 0) {
-		ERR("pthread_attr_init");
+	if( (conn = replica_connect(r->path)) < 0) {
+		fprintf(stderr, "No leader on %s, starting as the leader.\n", r->path);
+		return;
 	}
-	if(pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED) != 0) {
-		ERR("pthread_attr_setdetachstate");
+	if( (recs = (replica_record*) malloc(REPLICA_BATCH * sizeof(replica_record))) == NULL) {
+		ERR("malloc");
 	}
-
-	while(!exit_flag) {
-		fprintf(stderr, "Waiting for connection...\n");
-		if( (sock = accept(socket, NULL, NULL)) < 0) {
-			if(errno == EINTR && exit_flag) break;
-			ERR("accept");
+	fprintf(stderr, "Following the leader on %s.\n", r->path);
+	/* Signals stay blocked in main, SIGINT is only taken while waiting for the leader */
+	sigemptyset(&unblocked);
+	pfd.fd = conn;
+	pfd.events = POLLIN;
+	while(1) {
+		if(ppoll(&pfd, 1, NULL, &unblocked) < 0) {
+			if(errno != EINTR) {
+				ERR("ppoll");
+			}
+			if(exit_flag) {
+				fprintf(stderr, "Standby stopped.\n");
+				exit(EXIT_SUCCESS);
+			}
+			continue;
 		}
-		fprintf(stderr, "Accepted socket %d.\n", sock);
-		if( (thread_data = (player_th_data*) malloc(sizeof(player_th_data))) == NULL) {
-			ERR("malloc");
+		if( (len = TEMP_FAILURE_RETRY(read(conn, (char*) recs + have, REPLICA_BATCH * sizeof(replica_record) - have))) <= 0) {
+			if( (conn = replica_rejoin(r, conn)) < 0) {
+				break;
+			}
+			pfd.fd = conn;
+			have = 0;
+			applied = 0;
+			continue;
 		}
-		thread_data->socket = sock;
-		thread_data->players = players;
-		thread_data->state_mutex = args->state_mutex;
-		thread_data->state_cond = args->state_cond;
-		thread_data->cond = args->cond;
-		thread_data->mutex = args->mutex;
-		thread_data->bank_mutex = args->bank_mutex;
-		thread_data->state = args->state;
-		thread_data->horse_count = args->horse_count;
-		thread_data->horses = args->horses;
-		thread_data->curr_running_horses = args->curr_running_horses;
-		thread_data->winner = args->winner;
-		thread_data->players = args->players;
-		thread_data->bank = args->bank;
-		thread_data->time = args->time;
-		thread_data->interval = args->interval;
-		if(pthread_create(&id[i++], &thattr, handle_connection, (void*) thread_data) != 0) {
-			ERR("pthread_create");
+		have += len;
+		count = have / sizeof(replica_record);
+		for(i = 0; i < count; ++i) {
+			if(recs[i].type == REPLICA_END) {
+				break;
+			}
+			if(replica_apply(args, &recs[i]) < 0) {
+				fprintf(stderr, "Leader sent a record the standby cannot apply.\n");
+				exit(EXIT_FAILURE);
+			}
+			++applied;
+		}
+		if(i < count) {
+			/* Leader stops on purpose, the build taking over from it becomes the new leader */
+			++applied;
+			bulk_write(conn, (char*) &applied, sizeof(applied));
+			if(TEMP_FAILURE_RETRY(close(conn)) < 0) {
+				ERR("close");
+			}
+			if( (conn = replica_reconnect(r->path)) < 0) {
+				fprintf(stderr, "Leader stopped and no build took over, standby exiting.\n");
+				exit(EXIT_SUCCESS);
+			}
+			fprintf(stderr, "Following the new leader on %s.\n", r->path);
+			pfd.fd = conn;
+			have = 0;
+			applied = 0;
+			continue;
+		}
+		have -= count * sizeof(replica_record);
+		memmove(recs, recs + count, have);
+		if(bulk_write(conn, (char*) &applied, sizeof(applied)) < 0) {
+			if( (conn = replica_rejoin(r, conn)) < 0) {
+				break;
+			}
+			pfd.fd = conn;
+			have = 0;
+			applied = 0;
 		}
 	}
 
-	if(pthread_attr_destroy(&thattr) != 0) {
-		ERR("pthread_attr_destroy");
-	}
-
-	pthread_exit(NULL);
+	fprintf(stderr, "Leader lost, taking over with bank %d and %d tickets.\n", *args->bank, args->book->count);
+	free(recs);
+	replica_promote(args);
 }
 
-void read_configuration(horse** horses, horse** race_winner, int* horse_count, int* frequency, pthread_mutex_t* race_mutex, pthread_cond_t* race_cond, pthread_barrier_t* race_barrier, horse_args** hargs) {
-	FILE* file;
-	char buf[LINE_BUF];
+void print_metrics(server_metrics* metrics) {
+	unsigned long wakeups;
 	int i;
-	char* b;
-	pthread_attr_t thattr;
-
-	if(pthread_attr_init(&thattr) != 0) {
-		ERR("pthread_attr_init");
-	}
-	if(pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED) != 0) {
-		ERR("pthread_attr_setdetachstate");
-	}
-	
-	memset(buf, 0, LINE_BUF);
 
-	if( (file = fopen(SERVER_CONF_FILE, "r")) == NULL) {
-		ERR("fopen");
+	fprintf(stderr, "Metrics: commands %lu, rejected commands %lu, rejected bets %lu, refused local clients %lu, resumed sessions %lu\n",
+		__atomic_load_n(&metrics->commands, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->rejected_cmds, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->rejected_bets, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->rejected_peers, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->resumes, __ATOMIC_RELAXED));
+	if( (wakeups = __atomic_load_n(&metrics->replica_acks.wakeups, __ATOMIC_RELAXED)) > 0) {
+		fprintf(stderr, "Standby acknowledgements: bets %lu, avg %lu us, max %lu us, timed out %lu\n", wakeups,
+			__atomic_load_n(&metrics->replica_acks.total_ns, __ATOMIC_RELAXED) / wakeups / 1000,
+			__atomic_load_n(&metrics->replica_acks.max_ns, __ATOMIC_RELAXED) / 1000,
+			__atomic_load_n(&metrics->replica_timeouts, __ATOMIC_RELAXED));
 	}
-
-	/* Read frequency */
-	if(fgets(buf, LINE_BUF, file) == NULL) {
-		goto closed;
+	for(i = 0; i < ROLE_COUNT; ++i) {
+		if( (wakeups = __atomic_load_n(&metrics->sched[i].wakeups, __ATOMIC_RELAXED)) == 0) {
+			continue;
+		}
+		fprintf(stderr, "Scheduling latency %s: wakeups %lu, avg %lu us, max %lu us\n", role_names[i], wakeups,
+			__atomic_load_n(&metrics->sched[i].total_ns, __ATOMIC_RELAXED) / wakeups / 1000,
+			__atomic_load_n(&metrics->sched[i].max_ns, __ATOMIC_RELAXED) / 1000);
 	}
+}
 
-	*frequency = atoi(buf + strlen("FREQUENCY:"));
-	*frequency = 3600 / *frequency;
+/*
+* Applies CPU affinity and scheduling policy of a role to a running thread.
+* Failures (e.g. no permission for SCHED_FIFO) are reported and leave the thread to the scheduler.
+*
+* @tid:  thread to place
+* @conf: configuration holding placement of roles
+* @role: role of the thread (ROLE_*)
+*/
+void place_thread(pthread_t tid, server_conf* conf, int role) {
+	thread_role* r = &conf->roles[role];
+	struct sched_param param;
+	int err;
 
-	/* Read horse count */
-	if(fgets(buf, LINE_BUF, file) == NULL) {
-		goto closed;
+	if(r->pinned && (err = pthread_setaffinity_np(tid, sizeof(cpu_set_t), &r->cpus)) != 0) {
+		fprintf(stderr, "Cannot pin %s thread: %s\n", role_names[role], strerror(err));
 	}
-
-	*horse_count = atoi(buf + strlen("HORSE_COUNT:"));
-
-	if( (*horses = (horse*) calloc(*horse_count, sizeof(horse))) == NULL) {
-		fclose(file);
-		ERR("calloc");
+	if(r->priority > 0) {
+		param.sched_priority = r->priority;
+		if( (err = pthread_setschedparam(tid, SCHED_FIFO, &param)) != 0) {
+			fprintf(stderr, "Cannot set SCHED_FIFO for %s thread: %s\n", role_names[role], strerror(err));
+		}
 	}
+}
 
-	if( (*hargs = (horse_args*) calloc(*horse_count, sizeof(horse_args))) == NULL) {
-		fclose(file);
-		ERR("calloc");
-	}
+/*
+* Writes events of one ring matching the request as Chrome trace JSON.
+*
+* @file:  destination
+* @ring:  ring of one thread
+* @copy:  scratch buffer for trace.size events
+* @race:  race to dump, 0 for any
+* @since: oldest event end to dump
+* @first: tells whether no event was written to the file yet
+*/
+void trace_dump_ring(FILE* file, trace_ring* ring, trace_event* copy, int race, long since, int* first) {
+	unsigned long head, tail, i;
+	trace_event* ev;
 
-	
-	for(i = 0; i < *horse_count; ++i) {
-		if(fgets(buf, LINE_BUF, file) == NULL) {
-			goto closed;
-		}
-		b = strchr(buf, ' ') + 1;
-		strncpy((*horses)[i].name, b, MAX_NAME_LEN);
-		(*horses)[i].name[strlen(b) - 1] = '\0';
-		(*horses)[i].running = 0;
-		(*horses)[i].distance_run = 0;
-		(*horses)[i].rest_factor = 1;
-		(*horses)[i].mutex = race_mutex;
-		(*horses)[i].cond = race_cond;
-		(*horses)[i].barrier = race_barrier;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	memcpy(copy, ring->events, trace.size * sizeof(trace_event));
+	/* Owner may have been overwriting events while they were copied, drop those */
+	tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+	tail = (tail > trace.size) ? tail - trace.size : 0;
 
-		(*hargs)[i].winner = race_winner;
-		(*hargs)[i].horse_data = &(*horses)[i];
-	
-		if(pthread_create(&(*horses)[i].tid, &thattr, horse_thread, (void*) &((*hargs)[i])) != 0) {
-			ERR("pthread_create");
+	fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",\n", ring->id, ring->name);
+	*first = 0;
+	for(i = tail; i < head; ++i) {
+		ev = &copy[i & (trace.size - 1)];
+		if((race && ev->race != race) || ev->end < since) {
+			continue;
 		}
-	}
-
-closed:
-	if(fclose(file) == EOF) {
-		ERR("fclose");
-	}
-
-	if(pthread_attr_destroy(&thattr) != 0) {
-		ERR("pthread_attr_destroy");
+		fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"race\":%d}}",
+			ev->name, ring->id, ev->begin / 1000.0, (ev->end - ev->begin) / 1000.0, ev->race);
 	}
 }
 
-int init_race(horse* horses, race_args* args) {
-	int count = 0, in_running_index = 0, racing_horses = (MAX_HORSES_PER_RACE > args->horse_count) ? args->horse_count : MAX_HORSES_PER_RACE, i, index;
-	unsigned int seed = time(NULL);
+/*
+* Dumps recorded events to trace-<n>.json in Chrome/Perfetto format.
+* TRACE_REQUEST_FILE may choose the events: "race <n>" keeps one race, "last <seconds>" a time window,
+* without it everything still held by the rings is dumped.
+*/
+void trace_dump(void) {
+	FILE* file;
+	char path[LINE_BUF], what[LINE_BUF] = "all";
+	long value = 0, since = 0;
+	int race = 0, first = 1;
+	trace_event* copy;
+	trace_ring* ring;
 
-	for(i = 0; i < racing_horses; ++i) {
-		index = rand_r(&seed) % racing_horses;
-		if(horses[index].running == 0) {
-			horses[index].running = 1;
-			(*args->curr_running_horses)[in_running_index++] = &horses[index];
-			++count;
+	if( (file = fopen(TRACE_REQUEST_FILE, "r")) != NULL) {
+		if(fscanf(file, "%15s %ld", what, &value) != 2) {
+			strcpy(what, "all");
 		}
+		fclose(file);
 	}
-	pthread_barrier_init(args->barrier, NULL, count);
-
-	for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
-		if( (*args->curr_running_horses)[i]) {
-			printf("%s \t", (*args->curr_running_horses)[i]->name);
-		}
+	if(!strcmp(what, "race")) {
+		race = value;
+	} else if(!strcmp(what, "last")) {
+		since = monotonic_ns() - value * NSEC_PER_SEC;
 	}
 
-	return count;
-}
-
-void wait_for_race(int* state, pthread_mutex_t* state_mutex, pthread_cond_t* state_cond) {
-
-	if(pthread_mutex_lock(state_mutex) != 0) {
+	if( (copy = (trace_event*) malloc(trace.size * sizeof(trace_event))) == NULL) {
+		ERR("malloc");
+	}
+	if(pthread_mutex_lock(&trace.mutex) != 0) {
 		ERR("pthread_mutex_lock");
 	}
-	while(*state != STATE_RACING && !exit_flag) {
-		printf("State: NOT_RACING\n");
-		if(pthread_cond_wait(state_cond, state_mutex) != 0) {
-			ERR("pthread_cond_wait");
+	snprintf(path, LINE_BUF, "trace-%d.json", ++trace.dumps);
+	if( (file = fopen(path, "w")) == NULL) {
+		perror("fopen");
+	} else {
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		for(ring = trace.rings; ring; ring = ring->next) {
+			trace_dump_ring(file, ring, copy, race, since, &first);
+		}
+		fprintf(file, "\n]}\n");
+		if(fclose(file) == EOF) {
+			perror("fclose");
 		}
+		fprintf(stderr, "Trace written to %s (%s %ld)\n", path, what, value);
 	}
-	printf("State: RACING\n");
-	if(pthread_mutex_unlock(state_mutex) != 0) {
+	if(pthread_mutex_unlock(&trace.mutex) != 0) {
 		ERR("pthread_mutex_unlock");
 	}
+	free(copy);
 }
 
-void manage_prizes(int* bank, player** players, horse** winner) {
-	int total_win_bet = 0, i;
-	double percent;
-	for(i = 0; i < MAX_PLAYERS; ++i) {
-		if(players[i] && players[i]->horse_bet && !strcmp(players[i]->horse_bet->name, (*winner)->name)) {
-			total_win_bet += players[i]->money_bet;
+/*
+* Writes a trace dump on every SIGUSR2, SIGUSR2 stays blocked in all threads so only sigwait here takes it.
+*/
+void* trace_dumper(void* arg) {
+	sigset_t mask;
+	int sig;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	while(!exit_flag) {
+		if(sigwait(&mask, &sig) != 0) {
+			ERR("sigwait");
+		}
+		if(!exit_flag) {
+			trace_dump();
 		}
 	}
+	return NULL;
+}
 
-	for(i = 0; i < MAX_PLAYERS; ++i) {
-		if(players[i] && players[i]->horse_bet) {
-			if(!strcmp(players[i]->horse_bet->name, (*winner)->name)) {
-				percent = ((double) players[i]->money_bet / (double) total_win_bet);
-				players[i]->money += percent * (*bank);
+/*
+* Wakes up horses and sessions waiting for the next race turn.
+*/
+void race_broadcast(race_args* args) {
+	long begin = trace_begin();
 
-				players[i]->horse_bet = NULL;
-				players[i]->money_bet = 0;
-			} else {
-				players[i]->horse_bet = NULL;
-				players[i]->money_bet = 0;
-			}
-		}
+	__atomic_store_n(&args->metrics->tick_ns, monotonic_ns(), __ATOMIC_RELEASE);
+	if(pthread_cond_broadcast(args->cond) != 0) {
+		ERR("pthread_cond_broadcast");
 	}
-	if(total_win_bet != 0) {
-		*bank = 0;
+	trace_end("broadcast", begin);
+}
+
+/*
+* Wakes up the io_uring session loop after a race turn.
+*/
+void signal_tick(race_args* args) {
+	if(args->tick_fd >= 0 && eventfd_write(args->tick_fd, 1) < 0) {
+		ERR("eventfd_write");
 	}
 }
 
 void* server_handle_race(void* arg) {
 	race_args* args = (race_args*) arg;
 	int horse_count = args->horse_count, i;
+	long deadline, begin;
+	unsigned long tick;
+	int16_t order[BET_PLACES];
 	horse* horses = args->horses;
 	int* bank = args->bank;
 	player** players = args->players;
 	
 	single_pthread_sigmask(SIG_UNBLOCK, SIGUSR1);
+	trace_thread("race");
 
 	while(!exit_flag) {
+		__atomic_add_fetch(&trace.race, 1, __ATOMIC_RELAXED);
+		if(pthread_mutex_lock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
+		/* Field of the next race is drawn by the build taking over */
+		while(args->handoff->pending && !exit_flag) {
+			if(pthread_cond_wait(args->state_cond, args->state_mutex) != 0) {
+				ERR("pthread_cond_wait");
+			}
+		}
+		if(pthread_mutex_unlock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		begin = trace_begin();
+		/* A handoff accepted after the check waits until the field is complete */
+		ledger_lock(args->handoff);
 		init_race(horses, args);
+		ledger_unlock(args->handoff);
+		trace_end("init race", begin);
+		begin = trace_begin();
 		wait_for_race(args->state, args->state_mutex, args->state_cond);
+		trace_end("wait race", begin);
 		(*(args->winner)) = NULL;
-		if(pthread_cond_broadcast(args->cond) != 0) {
-			ERR("pthread_cond_broadcast");
-		}
+		publish_snapshot(args->snapshots);
+		tick = 0;
+		export_tick(args->export, tick);
+		replica_race(args->replica, REPLICA_TICK, args, tick);
+		tick_ring_record(args->ticks, args->tmpl, *args->winner, 1);
+		race_broadcast(args);
+		signal_tick(args);
 		
+		deadline = monotonic_ns();
 		while(!(*(args->winner)) && !exit_flag) {
-			sleep(1);
-			if(pthread_cond_broadcast(args->cond) != 0) {
-				ERR("pthread_cond_broadcast");
+			/* Absolute deadlines keep turns one second apart however late the thread wakes */
+			deadline += NSEC_PER_SEC;
+			if(sleep_until(deadline) == 0) {
+				sched_record(args->metrics, ROLE_RACE, deadline);
 			}
+			begin = trace_begin();
+			/* Horses are done moving, the turn is exported before they are woken again */
+			export_tick(args->export, ++tick);
+			replica_race(args->replica, REPLICA_TICK, args, tick);
+			tick_ring_record(args->ticks, args->tmpl, *args->winner, 0);
+			race_broadcast(args);
+			signal_tick(args);
 			printf("\n");
+			trace_end("tick", begin);
 		}
+		publish_snapshot(args->snapshots);
+		export_tick(args->export, tick);
+		tick_ring_end(args->ticks);
+		finish_order(args, order);
 
 		for(i = 0; i < horse_count; ++i) {
 			horses[i].running = 0;
@@ -806,19 +5714,27 @@ void* server_handle_race(void* arg) {
 		}
 		
 		fprintf(stderr, "cond broadcast after end\n");
-		if(pthread_cond_broadcast(args->cond) != 0) {
-			ERR("pthread_cond_broadcast");
-		}
+		race_broadcast(args);
 		
-		manage_prizes(bank, players, args->winner);
+		begin = trace_begin();
+		manage_prizes(bank, players, order, args->book, args->bank_mutex, args->replica, args->journal);
+		trace_end("settlement", begin);
 		for(i = 0; i < MAX_HORSES_PER_RACE; ++i) {
 			(*args->curr_running_horses)[i] = NULL;
 		}
-		if(pthread_cond_broadcast(args->cond) != 0) {
-			ERR("pthread_cond_broadcast");
-		}
+		race_broadcast(args);
 		
+		if(pthread_mutex_lock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_lock");
+		}
 		*args->state = STATE_NOT_RACING;
+		/* Betting window opens together with the state change a handoff waits for */
+		*args->time = time(NULL);
+		if(pthread_mutex_unlock(args->state_mutex) != 0) {
+			ERR("pthread_mutex_unlock");
+		}
+		publish_field(args->snapshots, *args->curr_running_horses);
+		print_metrics(args->metrics);
 		pthread_cond_broadcast(args->state_cond);
 
 		pthread_barrier_destroy(args->barrier);
@@ -864,14 +5780,37 @@ void destroy_syncs(pthread_mutex_t* race_mutex, pthread_mutex_t* state_mutex, pt
 	}
 }
 
-void manage_state(int frequency, time_t* count_start, int* state_value, pthread_cond_t* state_cond, pthread_mutex_t* state_mutex) {
+void manage_state(int frequency, time_t* count_start, int* state_value, pthread_cond_t* state_cond, pthread_mutex_t* state_mutex, race_snapshots* snapshots, server_metrics* metrics, handoff_state* handoff, track_export* export, replica_state* replica) {
+	long deadline, begin;
 
+	trace_thread("state");
 	while(!exit_flag) {
 		fprintf(stdout, "Next race in %d seconds...\n", frequency);
-		*count_start = time(NULL);
-		sleep(frequency);
+		if(handoff->resumed) {
+			/* Betting window started in the previous process */
+			handoff->resumed = 0;
+			deadline = monotonic_ns() + (*count_start + frequency - time(NULL)) * NSEC_PER_SEC;
+		} else {
+			/* Start of the window was set by the race thread (or main before the first race) */
+			deadline = monotonic_ns() + frequency * NSEC_PER_SEC;
+		}
+		publish_snapshot(snapshots);
+		export_countdown(export, *count_start + frequency);
+		replica_countdown(replica, *count_start + frequency);
+		begin = trace_begin();
+		if(sleep_until(deadline) == 0) {
+			sched_record(metrics, ROLE_STATE, deadline);
+		}
+		trace_end("betting window", begin);
 		printf("Woke up!\n");
+		pthread_mutex_lock(state_mutex);
+		/* Race does not start while the state is being handed over to the next build */
+		while(handoff->pending && !exit_flag) {
+			pthread_cond_wait(state_cond, state_mutex);
+		}
 		*state_value = STATE_RACING;
+		pthread_mutex_unlock(state_mutex);
+		publish_snapshot(snapshots);
 		pthread_cond_broadcast(state_cond);
 		pthread_mutex_lock(state_mutex);
 		while(*state_value != STATE_NOT_RACING && !exit_flag) {
@@ -904,7 +5843,7 @@ void cleaning(pthread_t* tid, int socket, player** players, horse** curr_running
 	}
 
 	for(i = 0; i < MAX_PLAYERS; ++i) {
-		free(players[i]);
+		pool_free(POOL_PLAYERS, players[i]);
 	}
 	free(players);
 	free(curr_running);
@@ -928,7 +5867,10 @@ void set_signal_handling(sigset_t* sigmask) {
 	sigemptyset(sigmask);
 	sigaddset(sigmask, SIGINT);
 	sigaddset(sigmask, SIGUSR1);
+	sigaddset(sigmask, SIGUSR2);
 	pthread_sigmask(SIG_BLOCK, sigmask, NULL);
+	/* SIGUSR2 (trace dump request) is left blocked when main unblocks the rest */
+	sigdelset(sigmask, SIGUSR2);
 }
 
 int main(int argc, char** argv) {
@@ -939,7 +5881,7 @@ int main(int argc, char** argv) {
 	horse* race_winner;
 	horse** curr_running;
 	player** players;
-	pthread_t tid[2];
+	pthread_t tid[2], trace_tid, handoff_tid;
 	pthread_mutex_t race_mutex, state_mutex, bank_mutex;
 	pthread_cond_t race_cond, state_cond;
 	pthread_barrier_t race_barrier;
@@ -947,14 +5889,34 @@ int main(int argc, char** argv) {
 	race_args race_arg;
 	sigset_t sigmask;
 	horse_args* hargs;
+	server_conf conf;
+	uring_loop loop;
+	int tick_fd = -1;
+	bet_book book;
+	race_template tmpl;
+	race_snapshots snapshots;
+	rate_limiter limiter;
+	server_metrics metrics;
+	handoff_state handoff;
+	track_export export;
+	replica_state replica;
+	bet_journal journal;
+	tick_ring ticks;
+	int upgrade_fd = -1, standby;
 	
-	if(argc != 2) {
+	if(argc != 2 && (argc != 3 || strcmp(argv[2], "--standby"))) {
 		usage();
 		exit(EXIT_FAILURE);
 	}
+	standby = (argc == 3);
 
 	set_signal_handling(&sigmask);
 
+	pool_init(&pools[POOL_SESSIONS], sizeof(player_th_data));
+	pool_init(&pools[POOL_PLAYERS], sizeof(player));
+	pool_init(&pools[POOL_SENDS], sizeof(uring_send));
+	memset(&book, 0, sizeof(bet_book));
+
 	if( (curr_running = (horse**) calloc(MAX_HORSES_PER_RACE, sizeof(horse*))) == NULL ) {
 		ERR("calloc");
 	}
@@ -969,11 +5931,24 @@ int main(int argc, char** argv) {
 
 	race_winner = NULL;
 
-	read_configuration(&horses, &race_winner, &horse_count, &frequency, &race_mutex, &race_cond, &race_barrier, &hargs);
+	default_conf(&conf);
+	memset(&metrics, 0, sizeof(server_metrics));
+	read_configuration(&horses, &race_winner, &horse_count, &frequency, &race_mutex, &race_cond, &race_barrier, &hargs, &conf, &metrics);
+	if(standby && !conf.replica_path[0]) {
+		fprintf(stderr, "Standby needs REPLICA_SOCKET in the configuration.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	count_start = time(NULL);
+	snapshot_init(&snapshots, &tmpl, &count_start, &frequency, &race_winner);
+	publish_field(&snapshots, curr_running);
+	rate_limiter_init(&limiter, &conf);
+	trace_init(conf.trace_events);
+	handoff_init(&handoff, conf.upgrade_path);
+	if(trace.enabled && pthread_create(&trace_tid, NULL, trace_dumper, NULL) != 0) {
+		ERR("pthread_create");
+	}
 
-	socket = make_socket(port);
-	
-	arguments1.socket = socket;
 	arguments1.horses = horses;
 	arguments1.horse_count = horse_count;
 	arguments1.state_mutex = &state_mutex;
@@ -988,8 +5963,81 @@ int main(int argc, char** argv) {
 	arguments1.bank = &bank;
 	arguments1.time = &count_start;
 	arguments1.interval = &frequency;
-	if(pthread_create(&tid[0], NULL, server_accept_connections, (void*) &arguments1) != 0) {
-		ERR("pthread_create");
+	arguments1.book = &book;
+	arguments1.tmpl = &tmpl;
+	arguments1.snapshots = &snapshots;
+	arguments1.limiter = &limiter;
+	arguments1.metrics = &metrics;
+	arguments1.io_role = &conf.roles[ROLE_IO];
+	arguments1.handoff = &handoff;
+	arguments1.export = &export;
+	arguments1.local = &conf.local;
+	arguments1.local_socket = -1;
+	arguments1.replica = &replica;
+	arguments1.ticks = &ticks;
+	handoff.args = &arguments1;
+	memset(&export, 0, sizeof(track_export));
+	tick_ring_init(&ticks);
+	replica_init(&replica, conf.replica_path, conf.replica_ack_ms, &arguments1);
+	if(standby) {
+		/* Returns once the leader is lost, the standby then serves the port itself */
+		replica_follow(&replica);
+		socket = make_socket(port);
+	} else if(handoff.path[0] && (upgrade_fd = handoff_connect(handoff.path)) >= 0) {
+		fprintf(stderr, "Taking over from the running server...\n");
+		socket = handoff_receive(&handoff, upgrade_fd);
+	} else {
+		socket = make_socket(port);
+	}
+	arguments1.socket = socket;
+	if(!conf.local.path[0] && arguments1.local_socket >= 0) {
+		/* Previous build served co-located clients, this configuration does not */
+		if(TEMP_FAILURE_RETRY(close(arguments1.local_socket)) < 0) {
+			ERR("close");
+		}
+		arguments1.local_socket = -1;
+	} else if(conf.local.path[0] && arguments1.local_socket < 0) {
+		/* Other users listed are let in by their credentials */
+		arguments1.local_socket = make_local_socket(conf.local.path, (conf.local.uid_count > 0) ? 0666 : 0600);
+	}
+	if(!replica.path[0] && replica.listen_fd >= 0) {
+		/* Previous build accepted a standby, this configuration does not replicate */
+		if(TEMP_FAILURE_RETRY(close(replica.listen_fd)) < 0) {
+			ERR("close");
+		}
+		replica.listen_fd = -1;
+	}
+	if(conf.io_backend == IO_BACKEND_URING) {
+		if( (tick_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+			ERR("eventfd");
+		}
+		if(uring_init(&loop, &arguments1, tick_fd) < 0) {
+			fprintf(stderr, "io_uring unavailable (%s), falling back to threads.\n", strerror(errno));
+			if(TEMP_FAILURE_RETRY(close(tick_fd)) < 0) {
+				ERR("close");
+			}
+			tick_fd = -1;
+			conf.io_backend = IO_BACKEND_THREADS;
+		}
+	}
+	if(conf.io_backend == IO_BACKEND_URING) {
+		handoff.loop = &loop;
+	}
+	if(upgrade_fd >= 0) {
+		handoff_adopt(&handoff, upgrade_fd);
+	}
+	if(conf.io_backend == IO_BACKEND_URING) {
+		fprintf(stderr, "Using io_uring session backend.\n");
+		if(pthread_create(&tid[0], NULL, server_uring_loop, (void*) &loop) != 0) {
+			ERR("pthread_create");
+		}
+		place_thread(tid[0], &conf, ROLE_IO);
+	} else {
+		fprintf(stderr, "Using thread-per-connection session backend.\n");
+		if(pthread_create(&tid[0], NULL, server_accept_connections, (void*) &arguments1) != 0) {
+			ERR("pthread_create");
+		}
+		place_thread(tid[0], &conf, ROLE_ACCEPT);
 	}
 
 	race_arg.horses = horses;
@@ -1005,16 +6053,84 @@ int main(int argc, char** argv) {
 	race_arg.players = players;
 	race_arg.bank = &bank;
 	race_arg.barrier = &race_barrier;
+	race_arg.tick_fd = tick_fd;
+	race_arg.book = &book;
+	race_arg.tmpl = &tmpl;
+	race_arg.snapshots = &snapshots;
+	race_arg.metrics = &metrics;
+	race_arg.export = &export;
+	race_arg.replica = &replica;
+	race_arg.journal = &journal;
+	race_arg.ticks = &ticks;
+	race_arg.time = &count_start;
+	race_arg.handoff = &handoff;
+	journal_open(&journal, conf.journal_path);
+	/* Opened after the previous build let go of the state, readers never see both writing */
+	export_init(&export, conf.export_name, &race_arg);
 	if( pthread_create(&tid[1], NULL, server_handle_race, (void*) &race_arg) != 0) {
 		ERR("pthread_create");
 	}
+	place_thread(tid[1], &conf, ROLE_RACE);
+	for(i = 0; i < horse_count; ++i) {
+		place_thread(horses[i].tid, &conf, ROLE_RACE);
+	}
+	/* Main thread runs the state timer, pinned last so no other role inherits its placement */
+	place_thread(pthread_self(), &conf, ROLE_STATE);
+	if(handoff.path[0]) {
+		handoff_listen(&handoff, &handoff_tid);
+	}
+	if(replica.path[0]) {
+		replica_listen(&replica);
+	}
 
 	pthread_sigmask(SIG_UNBLOCK, &sigmask, NULL);
 
 
-	manage_state(frequency, &count_start, &state_value, &state_cond, &state_mutex);
+	manage_state(frequency, &count_start, &state_value, &state_cond, &state_mutex, &snapshots, &metrics, &handoff, &export, &replica);
+	replica_end(&replica);
 
 	cleaning(tid, socket, players, curr_running, hargs, horses); 
+	if(arguments1.local_socket >= 0) {
+		if(TEMP_FAILURE_RETRY(close(arguments1.local_socket)) < 0) {
+			ERR("close");
+		}
+		if(conf.local.path[0] != '@') {
+			unlink(conf.local.path);
+		}
+	}
+	if(handoff.listen_fd >= 0) {
+		if(pthread_kill(handoff_tid, SIGUSR1) != 0) {
+			ERR("pthread_kill");
+		}
+		if(pthread_join(handoff_tid, NULL) != 0) {
+			ERR("pthread_join");
+		}
+	}
+	if(trace.enabled) {
+		if(pthread_kill(trace_tid, SIGUSR2) != 0) {
+			ERR("pthread_kill");
+		}
+		if(pthread_join(trace_tid, NULL) != 0) {
+			ERR("pthread_join");
+		}
+	}
+	if(tick_fd >= 0 && TEMP_FAILURE_RETRY(close(tick_fd)) < 0) {
+		ERR("close");
+	}
+	book_destroy(&book);
+	snapshot_destroy(&snapshots);
+	rate_limiter_destroy(&limiter);
+	print_metrics(&metrics);
+	trace_destroy();
+	handoff_destroy(&handoff);
+	replica_destroy(&replica);
+	journal_close(&journal);
+	tick_ring_destroy(&ticks);
+	export_destroy(&export);
+	pool_thread_flush();
+	for(i = 0; i < POOL_COUNT; ++i) {
+		pool_destroy(&pools[i]);
+	}
 
 	return EXIT_SUCCESS;
 }
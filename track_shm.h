@@ -0,0 +1,66 @@
+#ifndef TRACK_SHM_H
+#define TRACK_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+* Layout of the shared-memory segment the server exports live race state
+* through (EXPORT_SHM configuration entry). The server is the only writer,
+* readers map the segment read-only and copy it with track_shm_read.
+*/
+
+#define TRACK_SHM_MAGIC 0x42524455
+#define TRACK_SHM_VERSION 1
+#define TRACK_SHM_HORSES 8
+#define TRACK_SHM_NAME_LEN 16
+
+typedef struct {
+	char name[TRACK_SHM_NAME_LEN];	/* Name of the horse */
+	uint32_t distance;		/* Distance run in the current race */
+	float rest_factor;		/* Horse rest factor */
+	int32_t running;		/* Tells whether horse is running (==1 if so) */
+	int32_t pool;			/* Money on tickets for the horse */
+} track_shm_horse;
+
+typedef struct {
+	uint32_t magic;			/* TRACK_SHM_MAGIC */
+	uint32_t version;		/* TRACK_SHM_VERSION */
+	uint32_t seq;			/* Sequence counter, odd while the server updates the segment */
+	int32_t racing;			/* Tells whether a race is running (==1 if so) */
+	uint64_t race;			/* Number of races started */
+	uint64_t tick;			/* Turns run in the current/last race */
+	int64_t next_start;		/* Unix time the upcoming race starts */
+	int32_t bank;			/* Money in the bank (all pools) */
+	int32_t tickets;		/* Tickets of the upcoming/current race */
+	int32_t horse_count;		/* Horses in the field */
+	char last_winner[TRACK_SHM_NAME_LEN];	/* Winner of the last race (empty before first race) */
+	track_shm_horse field[TRACK_SHM_HORSES];	/* Horses of the upcoming/current race */
+} track_shm;
+
+/*
+* Copies a consistent state out of the segment without any system call.
+*
+* @shm:   mapped segment
+* @copy:  destination
+* @tries: attempts before giving up on a writer that keeps the segment busy
+*
+* Returns 0 on success, -1 if no consistent copy was made.
+*/
+static inline int track_shm_read(const track_shm* shm, track_shm* copy, int tries) {
+	uint32_t seq;
+
+	while(tries-- > 0) {
+		if( (seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) {
+			continue;
+		}
+		memcpy(copy, (const void*) shm, sizeof(track_shm));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "track_shm.h"
+
+#define READ_TRIES 1000000
+
+#define ERR(source) (perror(source),\
+		fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
+		exit(EXIT_FAILURE))
+
+void usage(void) {
+	fprintf(stderr, "USAGE: trackwatch name [interval_ms [count]]\n");
+}
+
+void print_state(track_shm* st) {
+	int i;
+
+	if(st->racing) {
+		printf("race %llu, tick %llu\n", (unsigned long long) st->race, (unsigned long long) st->tick);
+	} else {
+		printf("next race in %lld seconds\n", (long long) (st->next_start - time(NULL)));
+	}
+	printf("bank %d, tickets %d, last winner: %s\n", st->bank, st->tickets, st->last_winner);
+	for(i = 0; i < TRACK_SHM_HORSES; ++i) {
+		if(st->field[i].name[0]) {
+			printf("  %-16.16s distance %3u, rest %.3f, pool %d%s\n", st->field[i].name, st->field[i].distance,
+				st->field[i].rest_factor, st->field[i].pool, st->field[i].running ? "" : " (finished)");
+		}
+	}
+}
+
+/*
+* Polls race state exported by the server (EXPORT_SHM) and prints every
+* change seen, reading the segment without system calls or server load.
+*/
+int main(int argc, char** argv) {
+	int fd, interval = 100, count = -1;
+	uint32_t seen = 1;
+	track_shm* shm, st;
+
+	if(argc < 2 || argc > 4) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if(argc > 2) {
+		interval = atoi(argv[2]);
+	}
+	if(argc > 3) {
+		count = atoi(argv[3]);
+	}
+
+	if( (fd = shm_open(argv[1], O_RDONLY, 0)) < 0) {
+		ERR("shm_open");
+	}
+	if( (shm = (track_shm*) mmap(NULL, sizeof(track_shm), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ERR("mmap");
+	}
+	close(fd);
+
+	while(count != 0) {
+		if(track_shm_read(shm, &st, READ_TRIES) < 0) {
+			fprintf(stderr, "Segment stays busy, is the server stuck?\n");
+		} else if(st.magic != TRACK_SHM_MAGIC || st.version != TRACK_SHM_VERSION) {
+			fprintf(stderr, "Unknown segment layout.\n");
+			exit(EXIT_FAILURE);
+		} else if(st.seq != seen) {
+			seen = st.seq;
+			print_state(&st);
+			printf("\n");
+			fflush(stdout);
+			if(count > 0) {
+				--count;
+			}
+		}
+		usleep(interval * 1000);
+	}
+
+	munmap(shm, sizeof(track_shm));
+	return EXIT_SUCCESS;
+}